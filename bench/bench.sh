@@ -0,0 +1,115 @@
+#!/bin/bash
+#
+# bench.sh - loopback benchmark of the client and server through bench/netem
+# usage: bench/bench.sh (run from the top directory, or with make bench)
+#
+# For every link profile and file size, puts a file of random bytes to the
+# server and gets it back, through the emulator, and prints one CSV line per
+# transfer. Set in the environment to change the sweep:
+#   SIZES     file sizes in MB (default "1 16 64")
+#   PROFILES  link profiles below (default all of them)
+#   ARGS      options for both the client and the server, e.g. "-c bbr -f 32"
+#   PORT      server port; the emulator listens on PORT + 1 (default 9870)
+#   OUT       CSV file, also printed (default bench/results.csv)
+#
+# Columns: goodput is file bits over the time from starting the client to its
+# exit, retx_ratio the sender's retransmissions per packet, and the CPU
+# columns seconds of user plus system time per GB of file on each side.
+
+SIZES=${SIZES:-"1 16 64"}
+PROFILES=${PROFILES:-"clean loss1 reorder wan lossywan"}
+ARGS=${ARGS:-""}
+PORT=${PORT:-9870}
+TOP=$(pwd)
+OUT=$(realpath -m "${OUT:-bench/results.csv}")
+HZ=$(getconf CLK_TCK)
+
+# Emulator options of each profile
+netem_args(){
+  case $1 in
+    clean) echo "";; # no impairment, just the extra hop
+    loss1) echo "-l 1";;
+    reorder) echo "-r 5 -d 1";;
+    wan) echo "-D 10 -b 200";; # 20 ms RTT, 200 Mbit/s, 50 ms queue
+    lossywan) echo "-D 25 -b 100 -l 2 -r 1";;
+    *) echo "unknown profile $1" >&2; exit 1;;
+  esac
+}
+
+# CPU ticks used so far by process $1 and all its threads
+cpu_ticks(){
+  awk '{print $14 + $15}' /proc/$1/stat
+}
+
+# Runs one client command through the emulator; sets seconds and cpu (user + system)
+run_client(){
+  local times
+
+  times=$( { TIMEFORMAT="%R %U %S"; time timeout 600 "$TOP/client/client" $ARGS 127.0.0.1 $((PORT + 1)) \
+             <<< "$1" > "$WORK/client.log" 2>&1; } 2>&1 )
+  seconds=$(echo $times | awk '{print $1}')
+  cpu=$(echo $times | awk '{print $2 + $3}')
+}
+
+# Prints the CSV line of a transfer; the sender's log is $1
+report(){
+  awk -v profile=$PROFILE -v op=$2 -v bytes=$BYTES -v s=$seconds -v ccpu=$cpu -v sticks=$3 -v hz=$HZ -v ok=$4 '
+    /packets acknowledged/ { packets = $2; retx = $5 }
+    END {
+      gb = bytes/1e9
+      printf "%s,%s,%d,%.3f,%.1f,%.4f,%.2f,%.2f,%s\n", profile, op, bytes, s, (s > 0 ? bytes*8/s/1e6 : 0),
+             (packets > 0 ? retx/packets : 0), (gb > 0 ? ccpu/gb : 0), (gb > 0 ? sticks/hz/gb : 0), ok
+    }' "$1" | tee -a "$OUT"
+}
+
+cleanup(){
+  kill $SERVER $NETEM 2> /dev/null
+  wait 2> /dev/null
+  rm -rf "$WORK"
+}
+
+if [ ! -x client/client ] || [ ! -x server/server ] || [ ! -x bench/netem ]; then
+  echo "build first: make bench/netem all" >&2
+  exit 1
+fi
+WORK=$(mktemp -d)
+trap cleanup EXIT
+mkdir -p "$WORK/client/files/received" "$WORK/server/files"
+for size in $SIZES; do
+  head -c $((size*1024*1024)) /dev/urandom > "$WORK/client/files/bench_$size"
+done
+
+(cd "$WORK/server" && exec stdbuf -oL "$TOP/server/server" $ARGS $PORT > "$WORK/server.log" 2>&1) &
+SERVER=$!
+sleep 0.2
+echo "profile,op,bytes,seconds,goodput_mbit,retx_ratio,client_cpu_s_per_gb,server_cpu_s_per_gb,ok" | tee "$OUT"
+
+for PROFILE in $PROFILES; do
+  "$TOP/bench/netem" $(netem_args $PROFILE) $((PORT + 1)) $PORT 2> "$WORK/netem.log" &
+  NETEM=$!
+  sleep 0.1
+  cd "$WORK/client"
+  for size in $SIZES; do
+    BYTES=$((size*1024*1024))
+    rm -f "$WORK/server/files/bench_$size" "files/received/bench_$size"
+
+    for op in put get; do
+      lines=$(wc -l < "$WORK/server.log")
+      ticks=$(cpu_ticks $SERVER)
+      run_client "$op bench_$size"
+      ticks=$(( $(cpu_ticks $SERVER) - ticks ))
+      if [ $op = put ]; then
+        cmp -s "files/bench_$size" "$WORK/server/files/bench_$size" && ok=yes || ok=no
+        report "$WORK/client.log" $op $ticks $ok
+      else
+        cmp -s "files/bench_$size" "files/received/bench_$size" && ok=yes || ok=no
+        tail -n +$((lines + 1)) "$WORK/server.log" > "$WORK/sender.log"
+        report "$WORK/sender.log" $op $ticks $ok
+      fi
+    done
+  done
+  cd "$TOP"
+  kill $NETEM
+  wait $NETEM 2> /dev/null
+  sed "s/^/# $PROFILE /" "$WORK/netem.log" >&2
+done
@@ -0,0 +1,303 @@
+/*
+ * netem.c - a UDP link emulator for benchmarking over loopback
+ * usage: netem [-l loss%] [-r reorder%] [-d dup%] [-D delay_ms] [-b mbit] [-q queue_ms] <listen port> <server port>
+ *
+ * Clients send to the listen port; every client address gets its own socket
+ * towards the server, so the server sees one peer per client socket, as it
+ * would without the emulator. Both directions pass through their own link:
+ * a bandwidth cap with a drop-tail queue, a fixed delay, random loss,
+ * duplication and reordering.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MAX_CLIENTS 256
+#define MAX_QUEUED 65536 // packets in flight on both links
+#define MAX_DGRAM 65536
+#define REORDER_US 2000 // extra delay of a reordered packet
+
+// One emulated direction
+struct link{
+  uint64_t busy_until; // when the bottleneck finishes sending what is queued
+  uint64_t n_in;
+  uint64_t n_lost;
+  uint64_t n_dup;
+  uint64_t n_reordered;
+  uint64_t n_dropped; // by the full queue
+};
+
+// A datagram waiting for its delivery time
+struct pending{
+  uint64_t due;
+  int sockfd; // sent from this socket
+  struct sockaddr_in to;
+  int len;
+  char *data;
+};
+
+struct client{
+  struct sockaddr_in addr;
+  int sockfd; // towards the server
+};
+
+double loss = 0; // probabilities, 0 to 1
+double reorder = 0;
+double duplicate = 0;
+uint64_t delay_us = 0;
+double rate = 0; // bytes per microsecond, 0 for no cap
+uint64_t queue_us = 50000;
+
+struct pending *heap[MAX_QUEUED]; // ordered by due time
+int n_heap = 0;
+volatile sig_atomic_t done = 0; // set by SIGTERM or SIGINT
+
+void stop(int sig){
+  done = 1;
+}
+
+void error(char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+void usage(char *prog){
+  fprintf(stderr, "usage: %s [-l loss%%] [-r reorder%%] [-d dup%%] [-D delay_ms] [-b mbit] [-q queue_ms] <listen port> <server port>\n", prog);
+  exit(1);
+}
+
+uint64_t now_us(void){
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+double chance(void){
+  return (double)random()/RAND_MAX;
+}
+
+void heap_push(struct pending *p){
+  int i = n_heap++;
+  struct pending *tmp;
+
+  heap[i] = p;
+  while ((i > 0) && (heap[(i - 1)/2]->due > heap[i]->due)){
+    tmp = heap[i];
+    heap[i] = heap[(i - 1)/2];
+    heap[(i - 1)/2] = tmp;
+    i = (i - 1)/2;
+  }
+}
+
+struct pending *heap_pop(void){
+  struct pending *top = heap[0];
+  struct pending *tmp;
+  int i = 0;
+  int c;
+
+  heap[0] = heap[--n_heap];
+  while ((c = 2*i + 1) < n_heap){
+    if ((c + 1 < n_heap) && (heap[c + 1]->due < heap[c]->due))
+      c++;
+    if (heap[i]->due <= heap[c]->due)
+      break;
+    tmp = heap[i];
+    heap[i] = heap[c];
+    heap[c] = tmp;
+    i = c;
+  }
+  return top;
+}
+
+// Schedules one copy of a datagram on a link
+void schedule(struct link *l, int sockfd, struct sockaddr_in *to, char *data, int len, uint64_t now){
+  struct pending *p;
+  uint64_t start = l->busy_until > now ? l->busy_until : now;
+
+  if ((rate > 0) && (start - now > queue_us)){
+    l->n_dropped++;
+    return;
+  }
+  if (n_heap == MAX_QUEUED){
+    l->n_dropped++;
+    return;
+  }
+  p = malloc(sizeof(*p));
+  if (p != NULL)
+    p->data = malloc(len);
+  if ((p == NULL) || (p->data == NULL))
+    error("ERROR allocating packet");
+  if (rate > 0)
+    l->busy_until = start + len/rate;
+  else
+    l->busy_until = now;
+  p->due = l->busy_until + delay_us;
+  if (chance() < reorder){
+    p->due += REORDER_US;
+    l->n_reordered++;
+  }
+  p->sockfd = sockfd;
+  p->to = *to;
+  p->len = len;
+  memcpy(p->data, data, len);
+  heap_push(p);
+}
+
+// A datagram entering a link: lost, or scheduled once or twice
+void enter(struct link *l, int sockfd, struct sockaddr_in *to, char *data, int len){
+  uint64_t now = now_us();
+
+  l->n_in++;
+  if (chance() < loss){
+    l->n_lost++;
+    return;
+  }
+  schedule(l, sockfd, to, data, len, now);
+  if (chance() < duplicate){
+    l->n_dup++;
+    schedule(l, sockfd, to, data, len, now);
+  }
+}
+
+void print_link(char *name, struct link *l){
+  fprintf(stderr, "%s: %llu in, %llu lost, %llu duplicated, %llu reordered, %llu dropped by the queue\n", name,
+          (unsigned long long)l->n_in, (unsigned long long)l->n_lost, (unsigned long long)l->n_dup,
+          (unsigned long long)l->n_reordered, (unsigned long long)l->n_dropped);
+}
+
+int main(int argc, char **argv){
+  struct client clients[MAX_CLIENTS];
+  struct pollfd fds[MAX_CLIENTS + 1];
+  struct sockaddr_in listen_addr;
+  struct sockaddr_in server_addr;
+  struct sockaddr_in from;
+  struct link up;
+  struct link down;
+  struct pending *p;
+  struct sigaction sa;
+  socklen_t fromlen;
+  char *buf;
+  uint64_t now;
+  int n_clients = 0;
+  int listenfd;
+  int timeout;
+  int opt;
+  int n;
+  int i;
+
+  while ((opt = getopt(argc, argv, "l:r:d:D:b:q:")) != -1) {
+    switch (opt) {
+    case 'l': // percent of datagrams lost
+      loss = atof(optarg)/100;
+      break;
+    case 'r': // percent delayed behind later ones
+      reorder = atof(optarg)/100;
+      break;
+    case 'd': // percent duplicated
+      duplicate = atof(optarg)/100;
+      break;
+    case 'D': // one-way delay
+      delay_us = atof(optarg)*1000;
+      break;
+    case 'b': // bandwidth cap in Mbit/s
+      rate = atof(optarg)/8;
+      break;
+    case 'q': // bottleneck queue, in ms at the capped rate
+      queue_us = atof(optarg)*1000;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2)
+    usage(argv[0]);
+
+  bzero(&listen_addr, sizeof(listen_addr));
+  listen_addr.sin_family = AF_INET;
+  listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  listen_addr.sin_port = htons(atoi(argv[optind]));
+  server_addr = listen_addr;
+  server_addr.sin_port = htons(atoi(argv[optind + 1]));
+  listenfd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (listenfd < 0)
+    error("ERROR opening socket");
+  if (bind(listenfd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0)
+    error("ERROR on binding");
+  buf = malloc(MAX_DGRAM);
+  if (buf == NULL)
+    error("ERROR allocating buffer");
+  bzero(&up, sizeof(up));
+  bzero(&down, sizeof(down));
+  srandom(time(NULL) ^ getpid());
+  fds[0].fd = listenfd;
+  fds[0].events = POLLIN;
+
+  // No SA_RESTART, so poll returns and the counters get printed
+  bzero(&sa, sizeof(sa));
+  sa.sa_handler = stop;
+  sigaction(SIGTERM, &sa, NULL);
+  sigaction(SIGINT, &sa, NULL);
+
+  while (!done){
+    // Deliver what is due, then sleep until the next delivery or datagram
+    now = now_us();
+    while ((n_heap > 0) && (heap[0]->due <= now)){
+      p = heap_pop();
+      sendto(p->sockfd, p->data, p->len, 0, (struct sockaddr *)&p->to, sizeof(p->to));
+      free(p->data);
+      free(p);
+    }
+    timeout = n_heap > 0 ? (heap[0]->due - now + 999)/1000 : 1000;
+    n = poll(fds, n_clients + 1, timeout);
+    if (n < 0){
+      if (errno == EINTR)
+        continue;
+      error("ERROR in poll");
+    }
+
+    // Client to server
+    if (fds[0].revents & POLLIN){
+      fromlen = sizeof(from);
+      n = recvfrom(listenfd, buf, MAX_DGRAM, MSG_DONTWAIT, (struct sockaddr *)&from, &fromlen);
+      if (n >= 0){
+        for (i = 0; (i < n_clients) && (memcmp(&clients[i].addr, &from, sizeof(from)) != 0); i++)
+          ;
+        if ((i == n_clients) && (n_clients < MAX_CLIENTS)){
+          clients[i].addr = from;
+          clients[i].sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+          if (clients[i].sockfd < 0)
+            error("ERROR opening socket");
+          fds[i + 1].fd = clients[i].sockfd;
+          fds[i + 1].events = POLLIN;
+          n_clients++;
+        }
+        if (i < n_clients)
+          enter(&up, clients[i].sockfd, &server_addr, buf, n);
+      }
+    }
+
+    // Server to client
+    for (i = 0; i < n_clients; i++){
+      if (!(fds[i + 1].revents & POLLIN))
+        continue;
+      n = recv(clients[i].sockfd, buf, MAX_DGRAM, MSG_DONTWAIT);
+      if (n >= 0)
+        enter(&down, listenfd, &clients[i].addr, buf, n);
+    }
+
+  }
+  print_link("up", &up);
+  print_link("down", &down);
+  return 0;
+}
@@ -3,21 +3,131 @@
  * usage: udpserver <port>
  */
 
+#define _GNU_SOURCE // sendmmsg, recvmmsg
+#define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
 #include <stdbool.h>
 #include <netdb.h>
 #include <dirent.h>
 #include <sys/types.h> 
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h> // SSE4.2 crc32
+#endif
 
-#define BUFSIZE 1024
-#define DATASIZE 1020
+#define BUFSIZE 1024 // control datagrams, and data when probing finds nothing larger
+#define PKT_HDR 16 // packet id, session, CRC and send timestamp
+#define DATASIZE (BUFSIZE - PKT_HDR)
+#define MAX_BUFSIZE (9000 - 28) // a jumbo frame less the IPv4 and UDP headers
+#define MAX_DATASIZE (MAX_BUFSIZE - PKT_HDR)
 #define MAX_ID 4294967295
+#define ACK_ID (MAX_ID - 2) // receiver-to-sender acknowledgment
+#define PROBE_ID (MAX_ID - 3) // path MTU probe, and the receiver's echo of it
+#define REPAIR_ID (MAX_ID - 4) // FEC repair packet
+#define MAX_PACKETS REPAIR_ID // data packet IDs stay below the reserved ones
+
+#define ACK_RANGES 1 // ACK lists the missing ranges above the cumulative point
+#define ACK_BITMAP 2 // ... or carries a bitmap of the packets that arrived
+#define MAX_ACK_RANGES ((DATASIZE - sizeof(struct ack_info))/sizeof(struct range))
+#define MAX_ACK_BITS ((DATASIZE - sizeof(struct ack_info))*8)
+
+#define HEADER_MAGIC "!!HEADER_INFO!!"
+#define HEADER_VERSION 13
+#define HEADER_EOF_FOLLOWS 1 // header flag: EOF comes right after the data, so the receiver waits for it to ACK
+#define EOF_MARKER "!!END_FILE!!" // followed by the sender's content hash
+#define BAD_HASH "!!BAD_HASH!!" // receiver's answer to EOF when the content hash differs
+#define HASH_CHUNK (1024*1024) // receivers hash what arrived in order in pieces this big
+#define CHECKPOINT_MAGIC "!!RESUME_INFO!!"
+#define CHECKPOINT_US 2000000 // receivers save their bitmap this often
+#define WRITE_SLOTS 512 // packets a receiver can queue for its writer thread
+#define WRITE_MAX_IOV 64 // contiguous packets merged into one pwritev
+#define READ_BLOCK_PACKETS 64 // packets a sender's reader thread reads ahead at a time
+#define READ_BLOCKS 16 // blocks it keeps: half ahead of the sends, half behind for retransmissions
+#define READ_POLL_US 500 // how often a sender waiting on its reader looks again
+#define MAX_STREAMS 64 // stripes of one striped transfer
+#define STRIPE_ALIGN 4096 // stripes start on page boundaries
+
+#define PROBE_TRIES 3 // rounds of path MTU probes before settling for BUFSIZE
+#define PROBE_SLACK_US 1000 // extra wait for larger probes after the first echo
+
+#define WINDOW 16384 // packets in flight, and how far ahead the receiver accepts
+#define ACK_EVERY 16 // receiver ACKs at least every this many data packets
+#define ACK_INTERVAL_US 2000 // ... or this long after unacknowledged data
+#define REORDER_US 2000 // a hole sent this much before a delivered packet is lost, at least
+#define REORDER_MAX_MULT 8 // how far duplicates may widen that allowance
+#define REORDER_RESET 16 // ... until this many ACKs found losses and no duplicates
+#define INIT_RTO_US 250000 // retransmission timeout before the first RTT sample
+#define MIN_RTO_US 50000 // floor, so a receiver stalled on its disk is not taken for loss
+#define MAX_RTO_US 4000000 // ceiling of the backed-off timeout
+#define RTO_GRANULARITY_US 1000 // smallest variance term
+#define IDLE_TIMEOUT_US 30000000 // abandon a transfer after this much silence
+#define EOF_RETRIES 8 // each waits one backed-off RTO
+#define SOCKBUF_BYTES (4*1024*1024) // room for a full window in the kernel
+
+#define INIT_CWND 16 // congestion window, in packets
+#define MIN_CWND 4
+#define ACK_QUANTUM (2*ACK_EVERY) // headroom so delayed ACKs never starve the window
+#define INIT_RTT_US 10000 // assumed until the first RTT sample
+#define PACING_SLACK_US 1000 // pacing credit that may be spent as one burst
+#define BBR_BW_ROUNDS 10 // bandwidth filter length, in round trips
+#define MAX_BATCH 64 // datagrams per sendmmsg/recvmmsg call
+#define GSO_MAX_SEGS 63 // packets per segmentation-offload train (64 KB)
+#define GSO_MAX_BYTES 65507 // ... and bytes, which limits trains of jumbo packets
+#define GRO_BUFS 8 // coalesced super-packets per recvmmsg call
+#define GRO_BUFSIZE 65536
+#define MAX_VIEWS (GRO_BUFS*GSO_MAX_SEGS)
+#define FEC_MAX_BLOCK 1024 // data packets per FEC block, set with -f
+#define FEC_MAX_K 16 // repair packets per block
+#define CODEC_NONE 0
+#define CODEC_LZ4 1 // packets are compressed one by one with LZ4
+#define CODEC_DELTA 2 // packets are copies from the receiver's old file and literals
+#define DELTA_COPY 1 // delta op: 8-byte offset in the old file, 2-byte length
+#define DELTA_LITERAL 2 // delta op: 2-byte length, then the bytes
+#define SIG_MIN_BLOCK 1024 // signed block sizes for a delta put
+#define SIG_MAX_BLOCK 131072
+#define PROGRESS_US 5000000 // transfers log their counters this often
+#define LOG_QUIET 0 // -v levels: failures and results only
+#define LOG_INFO 1 // ... and transfer steps and summaries (default)
+#define LOG_DEBUG 2 // ... and batching and per-worker detail
+#define LOG_TRACE 3 // ... and every data packet
+#define LOG(level, ...) do { if (log_level >= (level)) printf(__VA_ARGS__); } while (0)
+#define SESSION_BITS 9
+#define SESSION_SLOTS (1 << SESSION_BITS) // session table size
+#define MAX_SESSIONS (SESSION_SLOTS/2) // concurrent transfers; keeps probe runs short
+#define MAX_WORKERS 256
+#define STATS_INTERVAL_US 1000000 // workers publish their counters for the stats dump this often
+#define LINGER_US (EOF_RETRIES*MAX_RTO_US) // a finished upload answers repeated EOFs this long
+#define CACHE_MB 512 // default memory budget of the file cache, set with -m
+#define CACHE_DIGESTS 8 // content hashes of stripes a cached file keeps
+#define SMALL_PACKETS 4 // gets of up to this many BUFSIZE packets go out in one flight
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 
 #define SetBit(A,k) ( A[((k)/32)] |= (1 << ((k)%32)) )
 #define TestBit(A,k) ( A[ ((k)/32)] & (1 << ((k)%32)) )
@@ -25,7 +135,545 @@
 // total size BUFSIZE
 struct packet{
   uint32_t id;
-  char data[DATASIZE];
+  uint32_t session; // picked by the client for each command, echoed by the server
+  uint32_t crc; // CRC32C of id, session, ts and data, in data packets
+  uint32_t ts; // sender's clock in microseconds when sent, in data packets
+  char data[MAX_DATASIZE];
+};
+
+/*
+ * Transfer header, carried in the data of the first packet. Versions 1 and 2
+ * predate the session field in the packet, versions 3 to 6 the CRC and
+ * versions 7 to 9 the timestamp, so their magic lands earlier and they are
+ * not recognized. A transfer carries bytes
+ * [stripe_offset, stripe_offset + stripe_bytes) of the file, the whole file
+ * unless it is one stripe of a striped transfer, in n_packets packets of
+ * datasize bytes. Packet IDs count from the start of the stripe, so stripes
+ * may settle on different packet sizes.
+ */
+struct header_info{
+  char magic[15];
+  uint8_t version;
+  uint64_t file_bytes;
+  uint64_t mtime; // of the source in ns, so a resumed transfer sees a changed file
+  uint64_t stripe_offset;
+  uint64_t stripe_bytes;
+  uint32_t n_packets;
+  uint32_t datasize; // negotiated by path MTU probing, less the repair header with FEC
+  uint32_t codec; // compression of packets whose payload is shorter than the packet
+  uint32_t flags; // HEADER_EOF_FOLLOWS
+  uint32_t fec_block; // data packets per FEC block of the sender, 0 if it sends no repairs
+};
+
+/*
+ * ACK payload. Every packet below cum has arrived, and [cum, upto) is
+ * described by count entries that follow: missing ranges (ACK_RANGES) or
+ * one bit per packet (ACK_BITMAP). Packets from upto on are not described.
+ */
+struct ack_info{
+  uint32_t cum;
+  uint32_t upto;
+  uint16_t format;
+  uint16_t count;
+  uint32_t repaired; // packets the receiver rebuilt with FEC so far
+  uint32_t ts_echo; // ts of the newest data packet the receiver has seen
+  uint32_t dups; // data packets it received twice so far
+};
+
+/*
+ * FEC repair packet payload, followed by the parity. A block is the n data
+ * packets from first on, and its repair packet for lane lane of k holds the
+ * XOR of packets first + lane, first + lane + k, ... with shorter packets
+ * padded with zeros.
+ */
+struct repair_info{
+  uint32_t first;
+  uint16_t n;
+  uint8_t lane;
+  uint8_t k;
+};
+
+struct range{
+  uint32_t start;
+  uint32_t len;
+};
+
+/*
+ * Block signatures of a file, sent by the server for a delta put: this
+ * header, then n_blocks struct block_sig, one per full block from the start
+ */
+struct sig_info{
+  uint64_t file_bytes;
+  uint32_t block; // bytes per block
+  uint32_t n_blocks;
+};
+
+struct block_sig{
+  uint64_t strong; // XXH64
+  uint32_t weak; // rsync rolling checksum
+  uint32_t unused;
+};
+
+// A block of the receiver's old copy found in the file being sent
+struct delta_match{
+  uint64_t offset; // in the file being sent
+  uint64_t base_offset; // ... and in the old copy
+};
+
+// Streaming XXH64 state
+struct xxh64{
+  uint64_t v[4];
+  uint64_t total;
+  uint8_t buf[32];
+  int buf_len;
+};
+
+/*
+ * Counters of a transfer, or the sum of finished transfers. Every field is
+ * a uint64_t so totals can be summed field by field. The sending side is
+ * filled in from the window by sender_stats; the receiving side counts as
+ * packets arrive.
+ */
+struct stats{
+  uint64_t transfers; // finished transfers, in a total
+  uint64_t pkts_sent; // data packets, retransmissions included
+  uint64_t bytes_sent; // their payload bytes, as sent
+  uint64_t retx;
+  uint64_t repairs; // FEC repair packets sent
+  uint64_t timeouts; // retransmission timer expiries that found losses
+  uint64_t tail_probes; // tail loss probes sent
+  uint64_t rtt_samples;
+  uint64_t rtt_sum_us;
+  uint64_t pkts_recv; // new data packets written
+  uint64_t bytes_recv; // their payload bytes, as received
+  uint64_t dups; // data packets that had already arrived
+  uint64_t crc_drops; // packets that failed the CRC check or did not decode
+  uint64_t repaired; // lost packets rebuilt with FEC
+  uint64_t acks; // ACKs sent
+  uint64_t nacks; // ... that reported missing packets
+  uint64_t writes;
+  uint64_t write_us; // time spent in them
+  uint64_t write_max_us;
+  uint64_t write_drops; // data packets dropped because the write queue was full
+};
+
+/*
+ * A receiver's bitmap of arrived packets, with two levels of summary so that
+ * finding the holes takes time in proportion to the holes, not the file:
+ * bit w of full is set once word w of bits is all ones, and bit j of full2
+ * once word j of full is. Bits past the end of each level are set, as if
+ * those packets had arrived, and count makes the completion check one
+ * comparison.
+ */
+struct recvmap{
+  uint32_t *bits; // one bit per packet, laid out as checkpoints save it
+  uint64_t len; // words of bits
+  uint64_t *full;
+  uint64_t len1; // words of full
+  uint64_t *full2;
+  uint64_t len2; // words of full2
+  uint32_t n_packets;
+  uint32_t count; // packets that have arrived
+};
+
+/*
+ * Decoded payloads of the last two FEC blocks a receiver got, so that a
+ * repair packet rebuilds its lane from memory instead of reading the file
+ * back. Packet id is kept in slot id % n_slots while tags holds id there.
+ */
+struct fec_store{
+  char *bufs;
+  uint32_t *tags;
+  uint32_t n_slots; // 0 if the sender sends no repairs
+  uint32_t datasize;
+};
+
+// A receiver's bitmap, copied for the writer thread to save
+struct checkpoint{
+  char fname[144];
+  int fd;
+  struct header_info info;
+  uint64_t recvmap_len;
+  uint32_t recvmap[];
+};
+
+// A file write queued for the writer thread: a packet, or a checkpoint
+struct write_job{
+  int fd;
+  int len;
+  off_t offset;
+  char *data; // len bytes in the writer's buffers
+  int hole; // the bytes are zeros, so punching a hole will do
+  struct stats *st; // counts the write
+  struct checkpoint *cp; // if not NULL, save this instead
+};
+
+/*
+ * Receivers hand packets to a writer thread instead of writing them on the
+ * network thread, so a stalled disk fills this queue rather than the socket
+ * buffer. The network thread is the only producer and the writer the only
+ * consumer: the network thread advances tail after filling a job, the
+ * writer advances head after its write, and neither takes a lock unless the
+ * other is asleep. Jobs are done in order, and each run of packets that
+ * continue one another in the same file is one pwritev.
+ */
+struct writer{
+  struct write_job jobs[WRITE_SLOTS];
+  char *bufs; // a payload buffer of slot_size bytes for each job
+  int slot_size;
+  uint64_t head; // next job to do
+  uint64_t tail; // next job to fill
+  int sleeping; // the writer waits on wake for jobs
+  int draining; // the network thread waits on idle for head to reach tail
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t idle;
+  pthread_t thread;
+};
+
+/*
+ * Reads a sender's file ahead of its sends on a thread of its own, so the
+ * network thread does not stall on the disk. Blocks of READ_BLOCK_PACKETS
+ * packets are read in order; block b goes in slot b % READ_BLOCKS of the
+ * pool, or, when the file is mapped, is only faulted into the page cache.
+ * The two threads share two counters without locks: the reader publishes
+ * filled once a block is in, and the network thread publishes sending, the
+ * block of its next new packet. The reader stays at most READ_BLOCKS/2
+ * blocks ahead of sending, so the half of the pool behind it still holds
+ * recent packets for retransmissions.
+ */
+struct reader{
+  int fd;
+  char *map; // the mapping, or NULL to read into bufs
+  char *bufs; // READ_BLOCKS blocks of block_size bytes, page aligned
+  uint64_t block_size;
+  uint64_t base; // the stripe, as in the source
+  uint64_t end;
+  uint32_t n_blocks;
+  uint32_t tags[READ_BLOCKS]; // block each slot holds
+  uint32_t filled; // blocks below this are read, except any sending skipped
+  uint32_t sending; // written only by the network thread
+  int sleeping; // the reader waits on wake for sending to move
+  int stop;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_t thread;
+};
+
+// Where a receiver's file is known to be written up to, see written_upto
+struct write_mark{
+  uint32_t cum; // every packet below it had been queued ...
+  uint64_t ticket; // ... once head reaches this
+  uint32_t written; // packets below this are in the file
+};
+
+// Sender-side state of one in-flight packet, indexed by id % WINDOW
+struct slot{
+  uint64_t sent_us; // time of the last transmission, 0 if never sent
+  uint64_t delivered; // window's delivered count when this was sent
+  uint64_t delivered_us; // ... and the time of that last delivery
+  uint8_t acked; // selectively acknowledged
+  uint8_t lost; // queued for retransmission
+  uint8_t retx; // sent more than once, so it gives no RTT sample
+};
+
+// Selective-repeat send window
+struct window{
+  uint32_t base; // lowest unacknowledged packet
+  uint32_t next; // next packet never sent
+  uint32_t end; // packets [0, end) are sent
+  uint32_t readable; // new packets below this are read ahead, see read_ahead
+  uint32_t n_retx;
+  uint32_t fec_n; // data packets per FEC block, 0 without FEC
+  uint32_t repaired; // packets the receiver rebuilt with FEC, from its ACKs
+  uint32_t n_timeouts; // retransmission timer expiries that found losses
+  uint32_t n_tail_probes;
+  int tlp_out; // a tail loss probe is out and no ACK has made progress since
+  uint64_t last_sent_us; // when the latest packet went out
+  uint64_t n_rtt; // RTT samples, and their sum
+  uint64_t rtt_sum_us;
+  uint32_t n_sacked; // acknowledged packets above base
+  uint64_t rack_us; // send time of the latest packet known to be delivered
+  uint32_t dups; // duplicates the receiver reported, from its ACKs
+  uint32_t reorder_mult; // reordering allowance in units of its base, see reorder_window
+  uint64_t reorder_round; // round_delivered when it was last widened
+  uint32_t n_clean; // ACKs since then that found losses and no duplicates
+  uint64_t delivered; // packets acknowledged so far
+  uint64_t delivered_us; // when the last of them was
+  uint64_t round_delivered; // acking a packet sent after this many deliveries ends a round trip
+  uint32_t lostq[WINDOW]; // packets waiting to be retransmitted
+  uint32_t lostq_head;
+  uint32_t lostq_len;
+  struct slot slots[WINDOW];
+};
+
+// Datagrams moved by one sendmmsg or recvmmsg call
+struct batch{
+  int size; // datagrams per call, set with -b
+  int len; // datagrams queued for sending
+  int offload; // send GSO trains / receive GRO super-packets, set with -g
+  int dgram; // size of a full outgoing datagram
+  struct mmsghdr msgs[MAX_BATCH];
+  struct iovec iov[2*MAX_BATCH]; // outgoing datagram i is iov[2i] (id) + iov[2i+1] (payload)
+  struct packet bufs[MAX_BATCH];
+  // GSO: the iovec pairs of a run of full-sized packets are adjacent, so each
+  // run goes out as one message that the kernel cuts into dgram-sized datagrams
+  struct mmsghdr trains[MAX_BATCH];
+  int train_first[MAX_BATCH];
+  int train_segs[MAX_BATCH];
+  char train_ctrl[MAX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+  // GRO: coalesced receives, split back into packets
+  char *gro_buf;
+  struct mmsghdr gro_msgs[GRO_BUFS];
+  struct iovec gro_iov[GRO_BUFS];
+  char gro_ctrl[GRO_BUFS][CMSG_SPACE(sizeof(int))];
+  // Received datagrams, whichever way they arrived
+  int n_views;
+  struct packet *views[MAX_VIEWS];
+  int view_len[MAX_VIEWS];
+  struct sockaddr_storage *view_from[MAX_VIEWS]; // who sent each one
+  struct sockaddr_storage from[MAX_BATCH];
+  struct sockaddr_storage gro_from[GRO_BUFS];
+  uint32_t session; // stamped on every outgoing datagram
+  uint64_t n_calls; // for the average batch fill
+  uint64_t n_msgs;
+};
+
+// The file being sent: mapped read-only when possible, so packets are sent
+// straight from the page cache, otherwise read through stdio
+struct source{
+  FILE *fp;
+  char *map;
+  uint64_t size;
+  uint64_t base; // packets cover bytes [base, end) of the file
+  uint64_t end;
+  uint32_t datasize; // bytes per packet
+  uint64_t mtime;
+  int codec;
+  uint64_t n_raw; // payload bytes sent, before and after compression
+  uint64_t n_packed;
+  uint64_t n_zero; // packets of zeros, sent without their bytes
+  struct delta_match *matches; // for a delta put, sorted by offset
+  uint64_t n_matches;
+  uint32_t block; // bytes per matched block
+  struct xxh64 hash; // content hash of the stripe, computed in file order
+  uint64_t hashed; // bytes of the stripe in the hash so far
+  struct reader *reader; // NULL until the packet size is known
+};
+
+// Repair packets of the FEC block being finished by a sender
+struct fec{
+  uint64_t n_sent; // repair packets sent
+  struct packet pkts[FEC_MAX_K];
+};
+
+// Path MTU search by the sender of a transfer
+struct probe{
+  int best; // largest datagram the receiver echoed, 0 if none yet
+  int tries; // rounds of probes sent
+  uint64_t sent_us; // when the last round went out
+  uint64_t done_us; // stop waiting for larger echoes then, 0 before the first echo
+  uint64_t timeout_us; // wait this long for echoes of a round, doubled each round
+  uint64_t rtt_us; // round trip to the first echo if the first round drew it, else 0
+};
+
+/*
+ * Retransmission timeout of a path, estimated in the style of RFC 6298 from
+ * RTT samples: the timestamp echoed by ACKs and the probes of a round that
+ * was not repeated. Each expiry doubles the timeout until the next sample.
+ */
+struct rto{
+  uint64_t srtt_us; // 0 before the first sample
+  uint64_t rttvar_us;
+  int backoff; // doublings since the last sample
+};
+
+// What one ACK told the sender, fed to the congestion controller
+struct cc_sample{
+  uint32_t acked; // newly acknowledged packets
+  uint32_t lost; // newly detected losses
+  uint32_t inflight; // packets still in flight afterwards
+  uint64_t rtt_us; // 0 if the ACK gave no valid sample
+  uint64_t echo_us; // RTT from the timestamp the ACK echoes, retransmissions included; 0 if none
+  uint64_t lost_sent_us; // send time of the latest packet found lost
+  double rate; // delivery rate in packets per second, 0 if none
+  int round_start; // a round trip has passed since the last round start
+};
+
+// Congestion controller state. It owns the congestion window and pacing rate.
+struct cc{
+  const struct cc_ops *ops;
+  double cwnd; // packets allowed in flight
+  double pacing_rate; // packets per second
+  double ssthresh;
+  uint64_t srtt_us;
+  uint64_t min_rtt_us;
+  uint64_t recovery_us; // losses of packets sent before this belong to a handled episode
+  // BBR-style model
+  int mode;
+  uint32_t round;
+  double bw; // bottleneck bandwidth estimate, packets per second
+  double bw_rounds[BBR_BW_ROUNDS]; // highest delivery rate seen in each recent round
+  double full_bw;
+  int full_bw_rounds;
+  int cycle;
+  uint64_t cycle_us;
+  double inflight_hi; // ceiling learned from loss, 0 if none
+};
+
+// A pluggable rate controller, selected with -c
+struct cc_ops{
+  const char *name;
+  void (*init)(struct cc *cc);
+  void (*on_ack)(struct cc *cc, const struct cc_sample *rs, uint64_t now);
+  void (*on_loss)(struct cc *cc, const struct cc_sample *rs);
+  void (*on_timeout)(struct cc *cc);
+};
+
+#define SESSION_PROBE 0 // get: probing the path MTU, header not sent yet
+#define SESSION_SEND 1 // get: sending the file
+#define SESSION_SEND_EOF 2 // get: everything acknowledged, waiting for the confirmation
+#define SESSION_RECV_HEADER 3 // put: waiting for the header, echoing probes
+#define SESSION_RECV 4 // put: receiving the file
+#define SESSION_RECV_DONE 5 // put: file complete, answering repeated EOFs
+
+// Content hash of one stripe of a cached file
+struct stripe_digest{
+  uint64_t base;
+  uint64_t len;
+  uint64_t digest;
+};
+
+/*
+ * A file that gets send from, kept mapped after they end, so the next get
+ * skips mapping and hashing it again. It is used only while the file keeps
+ * its inode, size and modification time.
+ */
+struct cache_entry{
+  char path[128]; // empty once the file changed, to be dropped when unused
+  dev_t dev;
+  ino_t ino;
+  uint64_t size;
+  uint64_t mtime;
+  char *map; // the whole file, read-only
+  int refs; // gets sending from it
+  struct stripe_digest digests[CACHE_DIGESTS]; // of stripes sent in full
+  int n_digests;
+  struct cache_entry *prev; // least recently used order, newest first
+  struct cache_entry *next;
+};
+
+/*
+ * Images of recently sent files, shared by all workers, up to budget bytes
+ * of them. Entries that no get is using are evicted, least recently used
+ * first, to make room for new ones.
+ */
+struct file_cache{
+  pthread_mutex_t lock;
+  struct cache_entry *head;
+  struct cache_entry *tail;
+  uint64_t budget; // 0 turns the cache off
+  uint64_t bytes;
+  int n_entries;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+// A striped put in progress: its stripes all write one temporary
+struct put_group{
+  char path[144]; // the temporary
+  uint64_t file_bytes; // of the client's file; if it changed, the stripes start over
+  uint64_t mtime;
+  int n_stripes;
+  uint64_t verified; // bit i is set once stripe i checked out
+  struct put_group *next;
+};
+
+// The striped puts of all workers, whose stripes may land on any of them
+struct put_groups{
+  pthread_mutex_t lock;
+  struct put_group *head;
+};
+
+// One client transfer, keyed by the session ID the client put in its command
+struct session{
+  uint32_t id;
+  int state;
+  struct worker *worker; // the thread that owns it
+  struct sockaddr_storage addr; // the client; packets from anywhere else are ignored
+  socklen_t addrlen;
+  char filename[128];
+  uint64_t last_recv; // last packet from the client, for the idle timeout
+  uint64_t timer; // next EOF or end of the linger
+  struct rto rto; // of the path to the client
+  // Sending
+  struct source src;
+  struct cache_entry *cached; // the file cache's image of the file, NULL if not cached
+  int cached_digest; // digest came from the cache, so the file is not hashed
+  struct probe probe;
+  int one_flight; // small get: no probing, and the EOF follows the data at once
+  struct window *w;
+  struct fec *fec; // NULL without FEC
+  struct cc cc;
+  struct batch *b;
+  struct packet header;
+  int header_len;
+  int got_ack;
+  int tries;
+  uint64_t last_header; // when the header last went out
+  uint64_t digest; // content hash of the stripe, sent with EOF
+  uint64_t next_send;
+  uint64_t next_scan;
+  uint64_t next_progress; // next periodic log of the counters
+  struct stats st; // a get's sending side is copied in from the window when it is freed
+  // Receiving
+  int fd;
+  char path[144]; // where a put writes: filename, or a temporary beside it for a delta put
+  int base_fd; // the old copy that a delta put copies from, -1 if none
+  struct header_info info; // what the client is sending
+  struct recvmap recvmap; // which packets arrived
+  struct fec_store fec_store; // recent payloads, for FEC rebuilds
+  uint32_t cum; // every packet below this has arrived
+  uint32_t highest; // one past the highest packet seen
+  uint32_t since_ack;
+  uint32_t ts_echo; // newest timestamp of a data packet, for the ACKs
+  struct write_mark mark; // how far the worker's writer has written the file
+  uint64_t last_ack;
+  uint64_t last_checkpoint;
+  struct xxh64 hash; // content hash of [0, hashed) of the stripe
+  uint64_t hashed;
+  int verified; // the content hash matched; repeated EOFs get the same answer
+  int stripe; // of a put, which replaces the file once every stripe is verified
+  int n_stripes;
+};
+
+/*
+ * A server thread with its own socket on the shared port. The kernel hashes
+ * each client's address to one of the sockets, so a client always reaches
+ * the same worker and every session lives in exactly one table.
+ */
+struct worker{
+  int index;
+  int cpu; // pinned to this CPU, -1 if not pinned
+  int sockfd;
+  pthread_t thread;
+  struct session *sessions[SESSION_SLOTS]; // open addressing on the session ID
+  int n_sessions;
+  // Stats
+  uint64_t n_gets;
+  uint64_t n_puts;
+  uint64_t n_recv; // datagrams received
+  uint64_t n_recv_calls;
+  uint64_t n_sent; // data datagrams sent by gets
+  struct stats totals; // of its finished transfers
+  struct writer writer; // writes the files of its puts, started by the first one
+  // What the stats dump reads, published by the worker under lock
+  pthread_mutex_t lock;
+  struct stats live; // the totals plus the transfers in progress
+  int live_sessions;
+  uint64_t next_publish;
 };
 
 /*
@@ -36,6 +684,11 @@ void error(char *msg) {
   exit(1);
 }
 
+void usage(char *prog){
+  fprintf(stderr, "usage: %s [-b batch] [-c aimd|bbr] [-f block] [-g] [-m cache_mb] [-s statsfile] [-v level] [-w workers] <port>\n", prog);
+  exit(1);
+}
+
 FILE *open_file(char *filename){
   FILE *fp;
   if (filename == NULL){
@@ -65,26 +718,6 @@ void ls(char *buf){
   }
 }
 
-// Waits for socket to be filled before receiving packet
-int recv_when_available(int sockfd, struct packet *recvbuf, struct sockaddr *from, socklen_t *fromlen){
-  struct timeval tv;
-  fd_set readfds;
-  int n_read;
-  tv.tv_sec = 2;
-  tv.tv_usec = 0;
-  FD_ZERO(&readfds);
-  FD_SET(sockfd, &readfds);
-  select(sockfd+1, &readfds, NULL, NULL, &tv);
-  if(FD_ISSET(sockfd, &readfds)){
-    n_read = recvfrom(sockfd, recvbuf, BUFSIZE, 0, from, fromlen);
-    if (n_read < 0){
-      printf("Receiving socket empty\n");
-    }
-    return n_read;
-  } else
-    printf("Timed out waiting for client reply\n");
-  return -1;
-}
 
 // Waits for socket to be available before sending packet
 int send_when_available(int sockfd, struct packet *data, int nbytes, const struct sockaddr *addr, socklen_t addrlen){
@@ -107,331 +740,3956 @@ int send_when_available(int sockfd, struct packet *data, int nbytes, const struc
 }
 
 
-void send_file(char *filename, int sockfd, struct sockaddr *addr, socklen_t addrlen){
-  int n_read;
-  int n_sent;
-  struct packet filebuf;
-  struct packet recvbuf;
-  char *eof = "!!END_FILE!!";
-  struct packet header;
-  uint32_t file_bytes;
-  uint32_t n_packets;
-  uint32_t packet_id;
-  uint32_t n_missing;
-  uint32_t *missing;
-  struct sockaddr_in from;
-  socklen_t fromlen = sizeof(struct sockaddr_storage);
-  FILE *fp;
+// Current monotonic time in microseconds, used by the transfer timers
+uint64_t now_us(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
 
-  fp = open_file(filename);
-  if (fp == NULL){
-    return;
+// Waits up to timeout_us for the socket to become readable (0 just polls)
+int wait_readable(int sockfd, uint64_t timeout_us){
+  struct timeval tv;
+  fd_set readfds;
+  tv.tv_sec = timeout_us/1000000;
+  tv.tv_usec = timeout_us%1000000;
+  FD_ZERO(&readfds);
+  FD_SET(sockfd, &readfds);
+  return select(sockfd+1, &readfds, NULL, NULL, &tv) > 0;
+}
+
+/*
+ * CRC32C (Castagnoli), a byte at a time from a table, or eight bytes at a
+ * time with the SSE4.2 crc32 instruction when the CPU has it
+ */
+uint32_t crc32c_table[256];
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len){
+  const uint8_t *p = buf;
+
+  while (len-- > 0)
+    crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len){
+  const uint8_t *p = buf;
+  uint64_t crc64 = crc;
+  uint64_t word;
+
+  while (len >= 8){
+    memcpy(&word, p, 8);
+    crc64 = _mm_crc32_u64(crc64, word);
+    p += 8;
+    len -= 8;
   }
+  crc = crc64;
+  while (len-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#endif
 
-  // find file size
-  fseek(fp, 0, SEEK_END);
-  file_bytes = (uint32_t)ftell(fp);
-  printf("Found %i bytes in file\n", file_bytes);
-  fseek(fp, 0, SEEK_SET);
-  n_packets = (file_bytes + DATASIZE - 1)/DATASIZE;
+uint32_t (*crc32c_update)(uint32_t crc, const void *buf, size_t len) = crc32c_sw;
 
-  // Send header
-  sprintf(header.data, "!!HEADER_INFO!!%i", n_packets);
-  header.id = n_packets;
-  n_sent = sendto(sockfd, &header, 23, 0, addr, addrlen);
-  if (n_sent < 0) 
-    error("ERROR in sendto");
-  printf("HEADER sent: %u packets\n", n_packets);
+void crc32c_init(void){
+  uint32_t crc;
+  int i;
+  int k;
 
-  // First pass: Send all packets in order
-  bzero(&filebuf, BUFSIZE);
-  packet_id = 0;
-  n_read = fread(&filebuf.data[0], 1, DATASIZE, fp); // get bytes from fp into filebuf
-  while(n_read > 0) {
-    filebuf.id = packet_id;
-    n_sent = send_when_available(sockfd, &filebuf, n_read+4, addr, addrlen);
-    //n_sent = sendto(sockfd, &filebuf, n_read+4, 0, servinfo->ai_addr, servinfo->ai_addrlen);
-    if (n_sent < 0) 
-      error("ERROR in sendto");
-    printf(". %i .", packet_id);
-    packet_id++;
-    bzero(&filebuf, BUFSIZE);
-    n_read = fread(&filebuf.data[0], 1, DATASIZE, fp);
-  }
-
-  while(1){
-    // Send EOF
-    bzero(&filebuf, BUFSIZE);
-    filebuf.id = MAX_ID;
-    strncpy(filebuf.data, eof, strlen(eof));
-    n_sent = send_when_available(sockfd, &filebuf, 16, addr, addrlen);
-    if (n_sent < 0) 
-      error("ERROR in sendto");
-    printf("EOF sent\n");
+  for (i = 0; i < 256; i++){
+    crc = i;
+    for (k = 0; k < 8; k++)
+      crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+    crc32c_table[i] = crc;
+  }
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    crc32c_update = crc32c_hw;
+#endif
+}
 
-    // Check for messages from server
-    bzero(&recvbuf, BUFSIZE);
-    n_read = recv_when_available(sockfd, &recvbuf, (struct sockaddr *)&from, &fromlen);
-    if(n_read < 0)
-      continue;
-    printf("Msg from client: %i\n", recvbuf.id);
-    if(recvbuf.id == 0)
-      printf("Completion of file %s\n", recvbuf.data);
+// CRC of a data packet: its id and session, its send timestamp, then len
+// bytes of payload
+uint32_t packet_crc(struct packet *pkt, const void *data, int len){
+  uint32_t crc = crc32c_update(~0u, pkt, 8);
 
-    // Send success
-    if((recvbuf.id == 0) && (strncmp(filename, &recvbuf.data[0], strlen(filename)) == 0)){ // Success
-      printf("GET file %s success!\n", filename);
-      return;
-    } else { // Or, some packets are missing
-      n_missing = recvbuf.id;
-      missing = (uint32_t *)&recvbuf.data[0];
-      int i = 0;
-      while(i < n_missing){ // Send up to 255 requested packets
-        bzero(&filebuf, BUFSIZE);
-        // Read from specific place in file and send that packet
-        packet_id = missing[i];
-        if (fseek(fp, packet_id*DATASIZE, SEEK_SET) <0)
-          error("ERROR in fseek");
-        n_read = fread(&filebuf.data[0], 1, DATASIZE, fp);
-        filebuf.id = packet_id;
-        n_sent = send_when_available(sockfd, &filebuf, n_read+4, addr, addrlen);
-        printf(". %i .", packet_id);
-        i++;
-      }
-    }
-  } 
+  crc = crc32c_update(crc, &pkt->ts, sizeof(pkt->ts));
+  return ~crc32c_update(crc, data, len);
 }
 
-int receive_file(char *fname, int sockfd, struct sockaddr_in *clientaddr, socklen_t *clientlen){
-  struct packet filebuf;
-  FILE *fp;
-  int n_read;
-  int n_sent;
-  int n;
-  uint32_t packet_id;
-  uint32_t npackets; // Can count to 4,294,967,295
-  uint32_t n_missing;
-  uint32_t *missing;
-  char debug_buffer[20];
+/*
+ * XXH64 with seed 0, fed incrementally, for the whole-file content hash.
+ * Both ends feed it the stripe in file order, whatever order the packets
+ * travel in, and compare the digests at EOF.
+ */
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
 
-  // create file
-  fp = fopen(fname, "w+b");
-  if (fp == NULL){
-    printf("Error opening file %s for writing\n", fname);
-    return -1;
+uint64_t xxh_rotl(uint64_t x, int r){
+  return (x << r) | (x >> (64 - r));
+}
+
+uint64_t xxh_round(uint64_t acc, uint64_t input){
+  acc += input*XXH_P2;
+  return xxh_rotl(acc, 31)*XXH_P1;
+}
+
+uint64_t xxh_merge(uint64_t acc, uint64_t v){
+  acc ^= xxh_round(0, v);
+  return acc*XXH_P1 + XXH_P4;
+}
+
+void xxh64_init(struct xxh64 *h){
+  bzero(h, sizeof(*h));
+  h->v[0] = XXH_P1 + XXH_P2;
+  h->v[1] = XXH_P2;
+  h->v[3] = -XXH_P1;
+}
+
+void xxh64_stripe(struct xxh64 *h, const uint8_t *p){
+  uint64_t lane;
+  int i;
+
+  for (i = 0; i < 4; i++){
+    memcpy(&lane, &p[8*i], 8);
+    h->v[i] = xxh_round(h->v[i], lane);
+  }
+}
+
+void xxh64_update(struct xxh64 *h, const void *data, size_t len){
+  const uint8_t *p = data;
+  size_t n;
+
+  h->total += len;
+  if (h->buf_len > 0){
+    n = 32 - h->buf_len < len ? 32 - h->buf_len : len;
+    memcpy(&h->buf[h->buf_len], p, n);
+    h->buf_len += n;
+    p += n;
+    len -= n;
+    if (h->buf_len < 32)
+      return;
+    xxh64_stripe(h, h->buf);
+    h->buf_len = 0;
   }
+  while (len >= 32){
+    xxh64_stripe(h, p);
+    p += 32;
+    len -= 32;
+  }
+  memcpy(h->buf, p, len);
+  h->buf_len = len;
+}
 
-  // receive header
-  // TODO: What if header is dropped?
-  while(1){
-    bzero(&filebuf, BUFSIZE);
-    n = recvfrom(sockfd, &filebuf, BUFSIZE, 0, (struct sockaddr *)clientaddr, clientlen);
-    if (n < 0)
-      error("ERROR in recvfrom");
-    //printf("Receive_file: %i byte header received\n", n);
-    if(strncmp(filebuf.data, "!!HEADER_INFO!!", 15) == 0){
-      npackets = filebuf.id;
-      printf("Received header: %u packets expected\n", npackets);
-      break;
-    }
+uint64_t xxh64_digest(struct xxh64 *h){
+  const uint8_t *p = h->buf;
+  const uint8_t *end = &h->buf[h->buf_len];
+  uint64_t acc;
+  uint64_t lane;
+  uint32_t half;
+
+  if (h->total >= 32){
+    acc = xxh_rotl(h->v[0], 1) + xxh_rotl(h->v[1], 7) + xxh_rotl(h->v[2], 12) + xxh_rotl(h->v[3], 18);
+    acc = xxh_merge(acc, h->v[0]);
+    acc = xxh_merge(acc, h->v[1]);
+    acc = xxh_merge(acc, h->v[2]);
+    acc = xxh_merge(acc, h->v[3]);
+  } else {
+    acc = XXH_P5;
+  }
+  acc += h->total;
+  while (p + 8 <= end){
+    memcpy(&lane, p, 8);
+    acc ^= xxh_round(0, lane);
+    acc = xxh_rotl(acc, 27)*XXH_P1 + XXH_P4;
+    p += 8;
+  }
+  if (p + 4 <= end){
+    memcpy(&half, p, 4);
+    acc ^= (uint64_t)half*XXH_P1;
+    acc = xxh_rotl(acc, 23)*XXH_P2 + XXH_P3;
+    p += 4;
+  }
+  while (p < end){
+    acc ^= *p*XXH_P5;
+    acc = xxh_rotl(acc, 11)*XXH_P1;
+    p++;
   }
+  acc ^= acc >> 33;
+  acc *= XXH_P2;
+  acc ^= acc >> 29;
+  acc *= XXH_P3;
+  acc ^= acc >> 32;
+  return acc;
+}
 
-  uint32_t recvmap_len = (npackets+32-1)/32; // 32 bits per int; round up
-  uint32_t recvmap[recvmap_len]; // array of bits to track which packets arrived
-  memset(recvmap, 0, recvmap_len * sizeof(uint32_t));
-  uint32_t all_ones[recvmap_len];
-  memset(all_ones, ~0, recvmap_len * sizeof(uint32_t));
+/*
+ * Folds bytes [base + *hashed, base + upto) of the file into the content
+ * hash, straight from the mapping if there is one, otherwise read back from
+ * the file (from the page cache, on a receiver that just wrote them)
+ */
+void hash_upto(struct xxh64 *h, uint64_t *hashed, int fd, char *map, uint64_t base, uint64_t upto){
+  char buf[65536];
+  uint64_t want;
+  ssize_t n;
 
-  // Set extra bits in recvmap to 1
-  // Don't do this if there were no extra bits
-  if(recvmap_len != npackets/32){
-    int extra = 32-(npackets%32);
-    while(extra > 0){
-      SetBit(recvmap, (recvmap_len*32)-extra);
-      extra--;
+  if (map != NULL){
+    if (upto > *hashed){
+      xxh64_update(h, &map[base + *hashed], upto - *hashed);
+      *hashed = upto;
+    }
+    return;
+  }
+  while (*hashed < upto){
+    want = upto - *hashed < sizeof(buf) ? upto - *hashed : sizeof(buf);
+    n = pread(fd, buf, want, base + *hashed);
+    if (n <= 0){
+      perror("ERROR reading back for the content hash");
+      return;
     }
+    xxh64_update(h, buf, n);
+    *hashed += n;
   }
+}
 
-  // Until we receive "EOF" signal and file is complete:
-  while(1){
-    bzero(&filebuf, BUFSIZE);
-    n_read = recvfrom(sockfd, &filebuf, BUFSIZE, 0, (struct sockaddr *)clientaddr, clientlen);
-    if (n_read < 0)
-      error("ERROR in recvfrom");
-    packet_id = filebuf.id;
-    printf(". %u .", packet_id);
+/*
+ * LZ4 block format, greedy and a single hash probe per position, for
+ * compressing packet payloads independently of each other. The output is
+ * what LZ4_decompress_safe() reads.
+ */
+#define LZ4_HASH_BITS 12
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5 // the block ends with at least this many literals
+#define LZ4_MF_LIMIT 12 // ... and no match starts this close to its end
 
-    // EOF received
-    if(packet_id == MAX_ID){
-      printf("EOF detected\n");
+// Writes the 255-run extension of a length that did not fit its nibble
+uint8_t *lz4_put_len(uint8_t *op, int len){
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
 
-      // Check if file is complete
-      if(memcmp(recvmap, all_ones, recvmap_len*4) == 0){
-        printf("File complete\n");
+// Emits one sequence: literals [anchor, anchor + lit), then a match of mlen
+// bytes at offset off, or no match if mlen is 0. Returns NULL if it does not fit.
+uint8_t *lz4_put_seq(uint8_t *op, uint8_t *oend, const uint8_t *anchor, int lit, int off, int mlen){
+  uint8_t *token = op++;
 
-        // Send confirmation packet
-        bzero(&filebuf, BUFSIZE);
-        strncpy(filebuf.data, fname, strlen(fname));
-        n_sent = sendto(sockfd, &filebuf, BUFSIZE, 0, (struct sockaddr *)clientaddr, *clientlen);
-        if (n_sent < 0) 
-          error("ERROR in sendto");
-        printf("Server sent completion acknowledgment\n");
+  if (op + lit + lit/255 + 1 + (mlen ? 2 + (mlen - LZ4_MIN_MATCH)/255 + 1 : 0) > oend)
+    return NULL;
+  *token = (lit >= 15 ? 15 : lit) << 4;
+  if (lit >= 15)
+    op = lz4_put_len(op, lit);
+  memcpy(op, anchor, lit);
+  op += lit;
+  if (mlen == 0)
+    return op;
+  *op++ = off & 0xff;
+  *op++ = off >> 8;
+  mlen -= LZ4_MIN_MATCH;
+  *token |= mlen >= 15 ? 15 : mlen;
+  if (mlen >= 15)
+    op = lz4_put_len(op, mlen);
+  return op;
+}
 
-        //Close and exit
-        fclose(fp);
-        return 1;
-      }
+/*
+ * Compresses len bytes of src into at most cap bytes of dst. Returns the
+ * compressed size, or 0 if it would not fit.
+ */
+int lz4_compress(const void *source, int len, void *dest, int cap){
+  const uint8_t *src = source;
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *end = src + len;
+  const uint8_t *match;
+  uint8_t *dst = dest;
+  uint8_t *op = dst;
+  int32_t table[1 << LZ4_HASH_BITS];
+  uint32_t seq;
+  uint32_t h;
+  int mlen;
 
-      // Prepare missing packets list
-      n_missing = 0;
-      missing = (uint32_t *)&filebuf.data[0];
-      // Loop through bit array
-      packet_id = 0;
-      while((packet_id < npackets) && (n_missing < 255)){ // Cap length of missing packets list)
-        // Make an array of missing packet IDs
-        if(!TestBit(recvmap, packet_id)){
-          missing[n_missing] = packet_id;
-          n_missing++;
-        }
-        packet_id++;
-      }
-      // Send list
-      filebuf.id = n_missing;
-      n_sent = sendto(sockfd, &filebuf, BUFSIZE, 0, (struct sockaddr *)clientaddr, *clientlen);
-      if (n_sent < 0) 
-        error("ERROR in sendto");
-      printf("Server sent missing packet info\n");
+  memset(table, 0xff, sizeof(table));
+  while (ip + LZ4_MF_LIMIT <= end){
+    memcpy(&seq, ip, 4);
+    h = (seq*2654435761u) >> (32 - LZ4_HASH_BITS);
+    match = table[h] < 0 ? NULL : &src[table[h]];
+    table[h] = ip - src;
+    if ((match == NULL) || (ip - match > 65535) || (memcmp(match, ip, 4) != 0)){
+      ip++;
       continue;
     }
+    for (mlen = LZ4_MIN_MATCH; (ip + mlen < end - LZ4_LAST_LITERALS) && (ip[mlen] == match[mlen]); mlen++)
+      ;
+    op = lz4_put_seq(op, dst + cap, anchor, ip - anchor, ip - match, mlen);
+    if (op == NULL)
+      return 0;
+    ip += mlen;
+    anchor = ip;
+  }
+  op = lz4_put_seq(op, dst + cap, anchor, end - anchor, 0, 0);
+  return op == NULL ? 0 : op - dst;
+}
+
+// Reads the 255-run extension of a length; -1 if it runs past the input
+int lz4_get_len(const uint8_t **ip, const uint8_t *iend){
+  int len = 0;
+  uint8_t b;
+
+  do {
+    if (*ip >= iend)
+      return -1;
+    b = *(*ip)++;
+    len += b;
+  } while (b == 255);
+  return len;
+}
 
-    // Mark received and write to file
-    SetBit(recvmap, packet_id);
+/*
+ * Decompresses len bytes of LZ4 block src into at most cap bytes of dst.
+ * Returns the decompressed size, or -1 if the input is malformed.
+ */
+int lz4_decompress(const void *source, int len, void *dest, int cap){
+  const uint8_t *ip = source;
+  const uint8_t *iend = ip + len;
+  uint8_t *dst = dest;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + cap;
+  uint8_t token;
+  int lit;
+  int mlen;
+  int off;
+  int ext;
 
-    //printf("Writing %.20s...\n", filebuf.data);
-    //printf("Seeking to position %u\n", packet_id * DATASIZE);
-    if ((n = fseek(fp, packet_id*DATASIZE, SEEK_SET)) < 0)
-      perror("Invalid seek");
-    n_sent = fwrite(&filebuf.data[0], 1, n_read-4, fp);
-    //printf("Wrote %i bytes at loc %u\n", n_read-4, packet_id*DATASIZE);
+  while (ip < iend){
+    token = *ip++;
+    lit = token >> 4;
+    if (lit == 15){
+      if ((ext = lz4_get_len(&ip, iend)) < 0)
+        return -1;
+      lit += ext;
+    }
+    if ((lit > iend - ip) || (lit > oend - op))
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend) // the last sequence has no match
+      break;
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | (ip[1] << 8);
+    ip += 2;
+    mlen = token & 15;
+    if (mlen == 15){
+      if ((ext = lz4_get_len(&ip, iend)) < 0)
+        return -1;
+      mlen += ext;
+    }
+    mlen += LZ4_MIN_MATCH;
+    if ((off == 0) || (off > op - dst) || (mlen > oend - op))
+      return -1;
+    for (; mlen > 0; mlen--, op++) // byte by byte, since the match may overlap
+      *op = op[-off];
   }
+  return op - dst;
+}
 
-  return 0;
+// XXH64 of len bytes at once
+uint64_t xxh64_of(const void *data, size_t len){
+  struct xxh64 h;
+
+  xxh64_init(&h);
+  xxh64_update(&h, data, len);
+  return xxh64_digest(&h);
 }
 
-int main(int argc, char **argv) {
-  int sockfd; /* socket */
-  int portno; /* port to listen on */
-  char *port;
-  socklen_t clientlen; /* byte size of client's address */
-  struct sockaddr_in serveraddr; /* server's addr */
-  struct sockaddr_in clientaddr; /* client addr */
-  struct hostent *hostp; /* client host info */
-  struct packet buf; /* message buf */
-  char *filename; /* filename pointer */
-  char hostaddrp[INET_ADDRSTRLEN];
-  int optval; /* flag value for setsockopt */
-  int n; /* message byte size */
-  char fnamebuf[128];
+/*
+ * rsync's rolling checksum of len bytes: a is their sum and b the sum of
+ * each weighted by its distance from the end, so sliding the window one
+ * byte is a = a - out + in, b = b - len*out + a
+ */
+uint32_t weak_sum(const uint8_t *p, uint32_t len, uint32_t *a, uint32_t *b){
+  uint32_t i;
 
-  /* 
-   * check command line arguments 
-   */
-  if (argc != 2) {
-    fprintf(stderr, "usage: %s <port>\n", argv[0]);
-    exit(1);
+  *a = 0;
+  *b = 0;
+  for (i = 0; i < len; i++){
+    *a += p[i];
+    *b += (len - i)*p[i];
   }
-  port = argv[1];
-  portno = atoi(argv[1]);
+  return (*a & 0xffff) | (*b << 16);
+}
 
-  // BEEJ p. 22
-  int status;
-  struct addrinfo hints;
-  struct addrinfo *servinfo;
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_INET;
-  hints.ai_socktype = SOCK_DGRAM;
-  hints.ai_flags = AI_PASSIVE;
-  if ((status = getaddrinfo(NULL, port, &hints, &servinfo)) != 0){
-    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
-    exit(1);
-  }
+// Block size for signing a file of file_bytes: about its square root, as rsync picks
+uint32_t sig_block(uint64_t file_bytes){
+  uint32_t block = SIG_MIN_BLOCK;
 
-  /* 
-   * socket: create the parent socket 
-   */
-  sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-  if (sockfd < 0) 
-    error("ERROR opening socket");
-
-  /* setsockopt: Handy debugging trick that lets 
-   * us rerun the server immediately after we kill it; 
-   * otherwise we have to wait about 20 secs. 
-   * Eliminates "ERROR on binding: Address already in use" error. 
-   */
-  optval = 1;
-  setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, 
-	    &optval, sizeof(optval));
+  while ((block < SIG_MAX_BLOCK) && ((uint64_t)block*block < file_bytes))
+    block *= 2;
+  return block;
+}
 
-  /* 
-   * bind: associate the parent socket with a port 
-   */
-  if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) < 0) 
-    error("ERROR on binding");
+// Appends a delta op to op, or returns NULL if it would pass dend
+char *delta_op(char *op, char *dend, int type, uint64_t base_offset, const char *data, uint16_t len){
+  if (op + (type == DELTA_COPY ? 11 : 3 + len) > dend)
+    return NULL;
+  *op++ = type;
+  if (type == DELTA_COPY){
+    memcpy(op, &base_offset, 8);
+    op += 8;
+  }
+  memcpy(op, &len, 2);
+  op += 2;
+  if (type == DELTA_LITERAL){
+    memcpy(op, data, len);
+    op += len;
+  }
+  return op;
+}
 
-  /* 
-   * main loop: wait for a datagram, then echo it
-   */
-  clientlen = sizeof(clientaddr);
-  while (1) {
+/*
+ * Encodes the len bytes of the file at offset, which raw holds, as copies
+ * from the receiver's old copy where they match one of its blocks and
+ * literals elsewhere. Copies of consecutive old blocks are merged. Returns
+ * the encoded size, or 0 if it would not fit in cap bytes.
+ */
+int delta_encode(struct source *src, uint64_t offset, const char *raw, int len, char *dst, int cap){
+  struct delta_match *m;
+  char *op = dst;
+  char *last_copy = NULL;
+  uint64_t last_end = 0; // offset in the old copy just past the last copy
+  uint64_t end = offset + len;
+  uint64_t pos = offset;
+  uint64_t start;
+  uint64_t stop;
+  uint64_t base_offset;
+  uint64_t lo = 0;
+  uint64_t hi = src->n_matches;
+  uint64_t mid;
+  uint16_t n;
 
+  // The first match that ends after offset
+  while (lo < hi){
+    mid = (lo + hi)/2;
+    if (src->matches[mid].offset + src->block <= offset)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (m = &src->matches[lo]; (m < &src->matches[src->n_matches]) && (m->offset < end) && (op != NULL); m++){
+    start = m->offset > pos ? m->offset : pos;
+    stop = m->offset + src->block < end ? m->offset + src->block : end;
+    base_offset = m->base_offset + (start - m->offset);
+    if (start > pos){
+      op = delta_op(op, dst + cap, DELTA_LITERAL, 0, &raw[pos - offset], start - pos);
+      last_copy = NULL;
+    }
+    if (op == NULL)
+      break;
+    if ((last_copy != NULL) && (last_end == base_offset)){
+      memcpy(&n, &last_copy[9], 2);
+      n += stop - start;
+      memcpy(&last_copy[9], &n, 2);
+    } else {
+      last_copy = op;
+      op = delta_op(op, dst + cap, DELTA_COPY, base_offset, NULL, stop - start);
+    }
+    last_end = base_offset + (stop - start);
+    pos = stop;
+  }
+  if ((op != NULL) && (pos < end))
+    op = delta_op(op, dst + cap, DELTA_LITERAL, 0, &raw[pos - offset], end - pos);
+  return op == NULL ? 0 : op - dst;
+}
+
+/*
+ * Rebuilds a delta-encoded packet into raw, reading its copies from base_fd,
+ * the receiver's old copy. Returns the bytes rebuilt, or -1 if the ops are
+ * malformed or overrun want.
+ */
+int delta_decode(int base_fd, const char *data, int len, char *raw, int want){
+  const char *ip = data;
+  const char *iend = data + len;
+  uint64_t base_offset;
+  uint16_t n;
+  int out = 0;
+
+  while (ip < iend){
+    if ((*ip == DELTA_COPY) && (iend - ip >= 11)){
+      memcpy(&base_offset, &ip[1], 8);
+      memcpy(&n, &ip[9], 2);
+      ip += 11;
+      if ((n > want - out) || (pread(base_fd, &raw[out], n, base_offset) != n))
+        return -1;
+    } else if ((*ip == DELTA_LITERAL) && (iend - ip >= 3)){
+      memcpy(&n, &ip[1], 2);
+      ip += 3;
+      if ((n > iend - ip) || (n > want - out))
+        return -1;
+      memcpy(&raw[out], ip, n);
+      ip += n;
+    } else {
+      return -1;
+    }
+    out += n;
+  }
+  return out;
+}
+
+const char *codec_names[] = {"none", "lz4", "delta", NULL};
+
+int find_codec(char *name){
+  int i;
+  for (i = 0; codec_names[i] != NULL; i++){
+    if (strcmp(codec_names[i], name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+/*
+ * Reads the optional "-z codec " in front of the rest of a get or put
+ * command. Returns the rest, or NULL if the codec is unknown.
+ */
+char *parse_codec(char *arg, int *codec){
+  char name[16];
+  int len = 0;
+
+  *codec = CODEC_NONE;
+  if (strncmp(arg, "-z ", 3) != 0)
+    return arg;
+  if ((sscanf(&arg[3], "%15s %n", name, &len) != 1) || (len == 0) || ((*codec = find_codec(name)) < 0))
+    return NULL;
+  return &arg[3 + len];
+}
+
+// Smoothed and minimum RTT, shared by every controller
+void cc_update_rtt(struct cc *cc, uint64_t rtt_us){
+  if (rtt_us == 0)
+    return;
+  if (cc->srtt_us == 0)
+    cc->srtt_us = rtt_us;
+  else
+    cc->srtt_us = (7*cc->srtt_us + rtt_us)/8;
+  if ((cc->min_rtt_us == 0) || (rtt_us < cc->min_rtt_us))
+    cc->min_rtt_us = rtt_us;
+}
+
+uint64_t cc_rtt(struct cc *cc){
+  return cc->srtt_us ? cc->srtt_us : INIT_RTT_US;
+}
+
+/*
+ * AIMD: slow start, then one packet of window growth per round trip, halving
+ * the window once per loss episode. Paced at a little above cwnd/RTT so the
+ * window is spread over the round trip instead of sent as a burst.
+ */
+void aimd_init(struct cc *cc){
+  cc->cwnd = INIT_CWND;
+  cc->ssthresh = WINDOW;
+  cc->pacing_rate = 2*cc->cwnd*1e6/INIT_RTT_US;
+}
+
+void aimd_on_ack(struct cc *cc, const struct cc_sample *rs, uint64_t now){
+  cc_update_rtt(cc, rs->rtt_us);
+  if (cc->cwnd < cc->ssthresh)
+    cc->cwnd += rs->acked;
+  else
+    cc->cwnd += rs->acked/cc->cwnd;
+  if (cc->cwnd > WINDOW)
+    cc->cwnd = WINDOW;
+  cc->pacing_rate = (cc->cwnd < cc->ssthresh ? 2.0 : 1.25)*cc->cwnd*1e6/cc_rtt(cc);
+}
+
+void aimd_on_loss(struct cc *cc, const struct cc_sample *rs){
+  cc->ssthresh = cc->cwnd/2 > MIN_CWND ? cc->cwnd/2 : MIN_CWND;
+  cc->cwnd = cc->ssthresh;
+  cc->pacing_rate = 1.25*cc->cwnd*1e6/cc_rtt(cc);
+}
+
+void aimd_on_timeout(struct cc *cc){
+  cc->ssthresh = cc->cwnd/2 > MIN_CWND ? cc->cwnd/2 : MIN_CWND;
+  cc->cwnd = MIN_CWND;
+  cc->pacing_rate = 2*cc->cwnd*1e6/cc_rtt(cc);
+}
+
+/*
+ * BBR-style: model the path as a bottleneck bandwidth (max delivery rate over
+ * the last BBR_BW_ROUNDS round trips) and a propagation delay (min RTT), pace
+ * at that bandwidth and keep about two bandwidth-delay products in flight.
+ * Startup doubles the rate each round until bandwidth stops growing, drain
+ * empties the queue it built, then probe_bw cycles the pacing gain to look
+ * for more bandwidth. Loss caps the window so we do not keep overflowing a
+ * shallow buffer.
+ */
+#define BBR_STARTUP 0
+#define BBR_DRAIN 1
+#define BBR_PROBE_BW 2
+
+double bbr_cycle_gain[8] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+void bbr_init(struct cc *cc){
+  cc->mode = BBR_STARTUP;
+  cc->cwnd = INIT_CWND;
+  cc->pacing_rate = 2.89*cc->cwnd*1e6/INIT_RTT_US;
+}
+
+void bbr_on_ack(struct cc *cc, const struct cc_sample *rs, uint64_t now){
+  double bdp;
+  double pacing_gain;
+  double cwnd_gain;
+  int i;
+
+  cc_update_rtt(cc, rs->rtt_us);
+  if (rs->round_start){
+    cc->round++;
+    cc->bw_rounds[cc->round % BBR_BW_ROUNDS] = 0;
+  }
+  if (rs->rate > cc->bw_rounds[cc->round % BBR_BW_ROUNDS])
+    cc->bw_rounds[cc->round % BBR_BW_ROUNDS] = rs->rate;
+  cc->bw = 0;
+  for (i = 0; i < BBR_BW_ROUNDS; i++){
+    if (cc->bw_rounds[i] > cc->bw)
+      cc->bw = cc->bw_rounds[i];
+  }
+  bdp = cc->bw*cc->min_rtt_us/1e6;
+
+  if ((cc->mode == BBR_STARTUP) && rs->round_start){
+    if (cc->bw >= 1.25*cc->full_bw){
+      cc->full_bw = cc->bw;
+      cc->full_bw_rounds = 0;
+    } else if (++cc->full_bw_rounds >= 3){
+      cc->mode = BBR_DRAIN;
+    }
+  }
+  if ((cc->mode == BBR_DRAIN) && (rs->inflight <= bdp)){
+    cc->mode = BBR_PROBE_BW;
+    cc->cycle = 0;
+    cc->cycle_us = now;
+  }
+  if ((cc->mode == BBR_PROBE_BW) && (now - cc->cycle_us > cc->min_rtt_us)){
+    cc->cycle = (cc->cycle + 1) % 8;
+    cc->cycle_us = now;
+    // Probing for bandwidth may also raise the loss ceiling
+    if ((cc->cycle == 0) && (cc->inflight_hi > 0))
+      cc->inflight_hi *= 1.25;
+  }
+
+  if (cc->mode == BBR_STARTUP){
+    pacing_gain = 2.89;
+    cwnd_gain = 2.89;
+  } else if (cc->mode == BBR_DRAIN){
+    pacing_gain = 1/2.89;
+    cwnd_gain = 2.89;
+  } else {
+    pacing_gain = bbr_cycle_gain[cc->cycle];
+    cwnd_gain = 2;
+  }
+
+  if (cc->bw > 0){
+    cc->pacing_rate = pacing_gain*cc->bw;
+    cc->cwnd = cwnd_gain*bdp + ACK_QUANTUM;
+  } else {
+    cc->cwnd += rs->acked;
+    cc->pacing_rate = pacing_gain*cc->cwnd*1e6/cc_rtt(cc);
+  }
+  if ((cc->inflight_hi > 0) && (cc->cwnd > cc->inflight_hi))
+    cc->cwnd = cc->inflight_hi;
+  if (cc->cwnd < ACK_QUANTUM)
+    cc->cwnd = ACK_QUANTUM;
+  if (cc->cwnd > WINDOW)
+    cc->cwnd = WINDOW;
+}
+
+void bbr_on_loss(struct cc *cc, const struct cc_sample *rs){
+  double hi = 0.85*(rs->inflight + rs->lost);
+
+  cc->inflight_hi = hi > ACK_QUANTUM ? hi : ACK_QUANTUM;
+  if (cc->mode == BBR_STARTUP){
+    cc->full_bw = cc->bw;
+    cc->mode = BBR_DRAIN;
+  } else if (cc->mode == BBR_PROBE_BW){
+    // Stop probing for the rest of this cycle
+    cc->cycle = 2;
+  }
+}
+
+void bbr_on_timeout(struct cc *cc){
+  cc->cwnd = MIN_CWND;
+}
+
+const struct cc_ops aimd_ops = {"aimd", aimd_init, aimd_on_ack, aimd_on_loss, aimd_on_timeout};
+const struct cc_ops bbr_ops = {"bbr", bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_timeout};
+const struct cc_ops *cc_algos[] = {&aimd_ops, &bbr_ops, NULL};
+const struct cc_ops *cc_algo = &aimd_ops; // used by send_file
+
+const struct cc_ops *find_cc(char *name){
+  int i;
+  for (i = 0; cc_algos[i] != NULL; i++){
+    if (strcmp(cc_algos[i]->name, name) == 0)
+      return cc_algos[i];
+  }
+  return NULL;
+}
+
+int batch_size = 32; // set with -b
+int offload = 0; // set with -g
+int fec_block = 0; // data packets per FEC block of our sends, set with -f
+int log_level = LOG_INFO; // set with -v
+char *stats_path = NULL; // SIGUSR1 dumps the counters here as JSON, or to stderr; set with -s
+volatile sig_atomic_t dump_requested = 0;
+
+struct batch *batch_alloc(const struct sockaddr *addr, socklen_t addrlen){
+  struct batch *b;
+  int i;
+
+  b = calloc(1, sizeof(struct batch));
+  if (b == NULL)
+    error("ERROR allocating packet batch");
+  b->size = batch_size;
+  b->dgram = BUFSIZE;
+  for (i = 0; i < MAX_BATCH; i++){
+    b->msgs[i].msg_hdr.msg_iov = &b->iov[2*i];
+    b->msgs[i].msg_hdr.msg_iovlen = 2;
+    b->msgs[i].msg_hdr.msg_name = (void *)addr;
+    b->msgs[i].msg_hdr.msg_namelen = addrlen;
+    b->trains[i].msg_hdr.msg_name = (void *)addr;
+    b->trains[i].msg_hdr.msg_namelen = addrlen;
+  }
+  if (offload && (addr == NULL)){ // only receive batches see super-packets
+    b->gro_buf = malloc(GRO_BUFS*GRO_BUFSIZE);
+    if (b->gro_buf == NULL)
+      error("ERROR allocating GRO buffers");
+    for (i = 0; i < GRO_BUFS; i++){
+      b->gro_iov[i].iov_base = &b->gro_buf[i*GRO_BUFSIZE];
+      b->gro_iov[i].iov_len = GRO_BUFSIZE;
+      b->gro_msgs[i].msg_hdr.msg_iov = &b->gro_iov[i];
+      b->gro_msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+  }
+  return b;
+}
+
+void batch_free(struct batch *b){
+  free(b->gro_buf);
+  free(b);
+}
+
+// Turns on GSO trains for this batch if the kernel supports UDP_SEGMENT
+void enable_gso(struct batch *b, int sockfd){
+  int zero = 0;
+
+  if (!offload)
+    return;
+  if (setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) < 0){
+    printf("UDP_SEGMENT not supported, sending packets one by one\n");
+    return;
+  }
+  b->offload = 1;
+}
+
+// Turns GRO on or off on the socket; only data loops should see super-packets
+void set_gro(struct batch *b, int sockfd, int on){
+  if (!offload || (b->gro_buf == NULL))
+    return;
+  if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0){
+    if (on)
+      printf("UDP_GRO not supported, receiving packets one by one\n");
+    b->offload = 0;
+    return;
+  }
+  b->offload = on;
+}
+
+/*
+ * Sends the queued datagrams as GSO trains. Returns the index of the first
+ * packet not sent, which is b->len unless the kernel refused the offload, in
+ * which case offload is switched off and the caller sends the rest plainly.
+ */
+int flush_trains(struct batch *b, int sockfd){
+  struct cmsghdr *cm;
+  fd_set writefds;
+  int n_trains = 0;
+  int i = 0;
+  int off = 0;
+  int max_segs = GSO_MAX_BYTES/b->dgram < GSO_MAX_SEGS ? GSO_MAX_BYTES/b->dgram : GSO_MAX_SEGS;
+  int segs;
+  int n;
+  int k;
+
+  while (i < b->len){
+    b->train_first[n_trains] = i;
+    segs = 0;
+    while ((i < b->len) && (segs < max_segs)){
+      if ((segs > 0) && (b->iov[2*i].iov_len + b->iov[2*i+1].iov_len > b->dgram)) // FEC repair packets go alone
+        break;
+      segs++;
+      i++;
+      if (b->iov[2*i-2].iov_len + b->iov[2*i-1].iov_len != b->dgram) // only the last segment may be short
+        break;
+    }
+    b->train_segs[n_trains] = segs;
+    b->trains[n_trains].msg_hdr.msg_iov = &b->iov[2*b->train_first[n_trains]];
+    b->trains[n_trains].msg_hdr.msg_iovlen = 2*segs;
+    if (segs > 1){
+      b->trains[n_trains].msg_hdr.msg_control = b->train_ctrl[n_trains];
+      b->trains[n_trains].msg_hdr.msg_controllen = sizeof(b->train_ctrl[n_trains]);
+      cm = CMSG_FIRSTHDR(&b->trains[n_trains].msg_hdr);
+      cm->cmsg_level = SOL_UDP;
+      cm->cmsg_type = UDP_SEGMENT;
+      cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      *(uint16_t *)CMSG_DATA(cm) = b->dgram;
+    } else {
+      b->trains[n_trains].msg_hdr.msg_control = NULL;
+      b->trains[n_trains].msg_hdr.msg_controllen = 0;
+    }
+    n_trains++;
+  }
+
+  while (off < n_trains){
+    FD_ZERO(&writefds);
+    FD_SET(sockfd, &writefds);
+    select(sockfd+1, NULL, &writefds, NULL, NULL);
+    n = sendmmsg(sockfd, &b->trains[off], n_trains - off, 0);
+    if (n < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      if (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP || errno == ENOPROTOOPT){
+        perror("GSO send failed, falling back to plain sendmmsg");
+        b->offload = 0;
+        return b->train_first[off];
+      }
+      error("ERROR in sendmmsg");
+    }
+    b->n_calls++;
+    for (k = off; k < off + n; k++)
+      b->n_msgs += b->train_segs[k];
+    off += n;
+  }
+  return b->len;
+}
+
+// Sends every queued datagram, waiting for the socket whenever it is full
+void batch_flush(struct batch *b, int sockfd){
+  fd_set writefds;
+  int off = 0;
+  int n;
+
+  if (b->offload)
+    off = flush_trains(b, sockfd);
+  while (off < b->len){
+    FD_ZERO(&writefds);
+    FD_SET(sockfd, &writefds);
+    select(sockfd+1, NULL, &writefds, NULL, NULL);
+    n = sendmmsg(sockfd, &b->msgs[off], b->len - off, 0);
+    if (n < 0){
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        continue;
+      error("ERROR in sendmmsg");
+    }
+    b->n_calls++;
+    b->n_msgs += n;
+    off += n;
+  }
+  b->len = 0;
+}
+
+// Queues the datagram whose iovec pair was just filled in
+void batch_queue(struct batch *b, int sockfd){
+  b->len++;
+  if (b->len >= b->size)
+    batch_flush(b, sockfd);
+}
+
+// Drains up to one batch of waiting datagrams into b->views and returns how many
+int batch_recv(struct batch *b, int sockfd){
+  struct cmsghdr *cm;
+  char *buf;
+  int seg;
+  int len;
+  int off;
+  int i;
+  int n;
+
+  b->n_views = 0;
+  if (!b->offload){
+    for (i = 0; i < b->size; i++){
+      b->iov[2*i].iov_base = &b->bufs[i];
+      b->iov[2*i].iov_len = MAX_BUFSIZE;
+      b->msgs[i].msg_hdr.msg_iovlen = 1;
+      b->msgs[i].msg_hdr.msg_name = &b->from[i];
+      b->msgs[i].msg_hdr.msg_namelen = sizeof(b->from[i]);
+    }
+    n = recvmmsg(sockfd, b->msgs, b->size, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++){
+      b->views[i] = &b->bufs[i];
+      b->view_len[i] = b->msgs[i].msg_len;
+      b->view_from[i] = &b->from[i];
+    }
+    b->n_views = n > 0 ? n : 0;
+  } else {
+    // Each GRO buffer holds equal-sized datagrams back to back; the
+    // UDP_GRO control message says how big they are
+    for (i = 0; i < GRO_BUFS; i++){
+      b->gro_msgs[i].msg_hdr.msg_control = b->gro_ctrl[i];
+      b->gro_msgs[i].msg_hdr.msg_controllen = sizeof(b->gro_ctrl[i]);
+      b->gro_msgs[i].msg_hdr.msg_name = &b->gro_from[i];
+      b->gro_msgs[i].msg_hdr.msg_namelen = sizeof(b->gro_from[i]);
+    }
+    n = recvmmsg(sockfd, b->gro_msgs, GRO_BUFS, MSG_DONTWAIT, NULL);
+    for (i = 0; i < n; i++){
+      buf = b->gro_iov[i].iov_base;
+      len = b->gro_msgs[i].msg_len;
+      seg = len;
+      for (cm = CMSG_FIRSTHDR(&b->gro_msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&b->gro_msgs[i].msg_hdr, cm)){
+        if ((cm->cmsg_level == SOL_UDP) && (cm->cmsg_type == UDP_GRO))
+          seg = *(int *)CMSG_DATA(cm);
+      }
+      if (seg <= 0)
+        seg = len;
+      for (off = 0; (off < len) && (b->n_views < MAX_VIEWS); off += seg){
+        b->views[b->n_views] = (struct packet *)&buf[off];
+        b->view_len[b->n_views] = len - off < seg ? len - off : seg;
+        b->view_from[b->n_views] = &b->gro_from[i];
+        b->n_views++;
+      }
+    }
+  }
+  if (n > 0){
+    b->n_calls++;
+    b->n_msgs += b->n_views;
+  }
+  return b->n_views;
+}
+
+void print_batch_stats(char *what, struct batch *b){
+  LOG(LOG_INFO, "%s: %llu calls, %.1f packets per call\n", what, (unsigned long long)b->n_calls, b->n_calls ? (double)b->n_msgs/b->n_calls : 0.0);
+}
+
+// Adds a transfer's counters into a total
+void add_stats(struct stats *total, struct stats *st){
+  uint64_t *t = &total->transfers;
+  uint64_t *s = &st->transfers;
+  uint64_t write_max_us = total->write_max_us;
+  size_t i;
+
+  for (i = 0; i < sizeof(*st)/sizeof(uint64_t); i++)
+    t[i] += s[i];
+  total->write_max_us = st->write_max_us > write_max_us ? st->write_max_us : write_max_us;
+}
+
+// Logs the counters of a transfer, or a total, on the sides it has
+void print_stats(char *what, struct stats *st){
+  if (st->pkts_sent > 0)
+    LOG(LOG_INFO, "%s: %llu packets (%llu bytes) sent, %llu retransmitted, %llu FEC repairs, %llu timeouts, %llu tail probes, RTT %llu us average over %llu samples\n",
+        what, (unsigned long long)st->pkts_sent, (unsigned long long)st->bytes_sent, (unsigned long long)st->retx, (unsigned long long)st->repairs,
+        (unsigned long long)st->timeouts, (unsigned long long)st->tail_probes, (unsigned long long)(st->rtt_samples ? st->rtt_sum_us/st->rtt_samples : 0), (unsigned long long)st->rtt_samples);
+  if (st->pkts_recv + st->acks > 0)
+    LOG(LOG_INFO, "%s: %llu packets (%llu bytes) received, %llu duplicates, %llu dropped, %llu rebuilt, %llu ACKs (%llu reporting losses), "
+        "%llu writes %.1f us average, %llu us max, %llu dropped with the write queue full\n",
+        what, (unsigned long long)st->pkts_recv, (unsigned long long)st->bytes_recv, (unsigned long long)st->dups, (unsigned long long)st->crc_drops,
+        (unsigned long long)st->repaired, (unsigned long long)st->acks, (unsigned long long)st->nacks, (unsigned long long)st->writes,
+        st->writes ? (double)st->write_us/st->writes : 0.0, (unsigned long long)st->write_max_us, (unsigned long long)st->write_drops);
+}
+
+// Writes counters as the members of a JSON object
+void print_stats_json(FILE *out, struct stats *st){
+  fprintf(out, "\"transfers\": %llu, \"packets_sent\": %llu, \"bytes_sent\": %llu, \"retransmits\": %llu, \"fec_repairs\": %llu, "
+          "\"timeouts\": %llu, \"tail_probes\": %llu, \"rtt_samples\": %llu, \"rtt_avg_us\": %llu, \"packets_received\": %llu, \"bytes_received\": %llu, "
+          "\"duplicates\": %llu, \"dropped\": %llu, \"rebuilt\": %llu, \"acks\": %llu, \"nacks\": %llu, \"writes\": %llu, "
+          "\"write_avg_us\": %.1f, \"write_max_us\": %llu, \"write_drops\": %llu",
+          (unsigned long long)st->transfers, (unsigned long long)st->pkts_sent, (unsigned long long)st->bytes_sent, (unsigned long long)st->retx,
+          (unsigned long long)st->repairs, (unsigned long long)st->timeouts, (unsigned long long)st->tail_probes, (unsigned long long)st->rtt_samples,
+          (unsigned long long)(st->rtt_samples ? st->rtt_sum_us/st->rtt_samples : 0), (unsigned long long)st->pkts_recv,
+          (unsigned long long)st->bytes_recv, (unsigned long long)st->dups, (unsigned long long)st->crc_drops, (unsigned long long)st->repaired,
+          (unsigned long long)st->acks, (unsigned long long)st->nacks, (unsigned long long)st->writes,
+          st->writes ? (double)st->write_us/st->writes : 0.0, (unsigned long long)st->write_max_us, (unsigned long long)st->write_drops);
+}
+
+// SIGUSR1: the loops check the flag and dump the counters where it is safe
+void request_dump(int sig){
+  dump_requested = 1;
+}
+
+/*
+ * Opens where a stats dump goes: a temporary beside the -s file, which
+ * close_dump renames over it so readers never see half a dump, or stderr
+ */
+FILE *open_dump(char *tmp, size_t size){
+  FILE *out;
+
+  if (stats_path == NULL)
+    return stderr;
+  snprintf(tmp, size, "%s.tmp", stats_path);
+  out = fopen(tmp, "w");
+  if (out == NULL)
+    perror("ERROR opening the stats file");
+  return out;
+}
+
+void close_dump(FILE *out, char *tmp){
+  if (out == stderr){
+    fflush(out);
+    return;
+  }
+  fclose(out);
+  if (rename(tmp, stats_path) < 0)
+    perror("ERROR replacing the stats file");
+}
+
+// Bytes of the stripe in block b of a reader, and where they start
+uint64_t read_block_range(struct reader *r, uint32_t b, uint64_t *offset){
+  *offset = r->base + (uint64_t)b*r->block_size;
+  return r->end - *offset < r->block_size ? r->end - *offset : r->block_size;
+}
+
+void *run_reader(void *arg){
+  struct reader *r = arg;
+  sigset_t all;
+  uint64_t offset;
+  uint64_t len;
+  uint64_t i;
+  uint32_t b = 0;
+  uint32_t sending;
+  volatile char touch;
+  ssize_t n;
+  int stop;
+
+  // Signals are for the network threads
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  while (1){
+    sending = __atomic_load_n(&r->sending, __ATOMIC_SEQ_CST);
+    if ((b >= r->n_blocks) || (b >= sending + READ_BLOCKS/2)){
+      // Sleep; the network thread only signals if it sees sleeping set, so
+      // it is set before the last look at sending
+      pthread_mutex_lock(&r->lock);
+      __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+      while (!r->stop && ((b >= r->n_blocks) || (b >= __atomic_load_n(&r->sending, __ATOMIC_SEQ_CST) + READ_BLOCKS/2)))
+        pthread_cond_wait(&r->wake, &r->lock);
+      __atomic_store_n(&r->sleeping, 0, __ATOMIC_SEQ_CST);
+      stop = r->stop;
+      pthread_mutex_unlock(&r->lock);
+      if (stop)
+        return NULL;
+      continue;
+    }
+    if (b < sending)
+      b = sending; // a resumed receiver already has what the sends skipped
+
+    // Start the kernel on the far end of the run-ahead, then bring this
+    // block in: into the page cache under the mapping, or into the pool
+    if (b + READ_BLOCKS/2 < r->n_blocks){
+      len = read_block_range(r, b + READ_BLOCKS/2, &offset);
+      posix_fadvise(r->fd, offset, len, POSIX_FADV_WILLNEED);
+    }
+    len = read_block_range(r, b, &offset);
+    if (r->map != NULL){
+      for (i = 0; i < len; i += 4096)
+        touch = r->map[offset + i];
+      (void)touch;
+    } else {
+      for (i = 0; i < len; i += n){
+        n = pread(r->fd, &r->bufs[(b % READ_BLOCKS)*r->block_size + i], len - i, offset + i);
+        if (n < 0)
+          error("ERROR in pread");
+        if (n == 0)
+          break;
+      }
+      __atomic_store_n(&r->tags[b % READ_BLOCKS], b, __ATOMIC_RELAXED);
+    }
+    b++;
+    __atomic_store_n(&r->filled, b, __ATOMIC_RELEASE);
+  }
+}
+
+/*
+ * Starts reading the source ahead of its sends, once its packet size is
+ * known. Sends of new packets wait for it, see read_ahead.
+ */
+void reader_start(struct source *src, uint32_t n_packets){
+  struct reader *r;
+  int i;
+
+  if (n_packets == 0)
+    return;
+  r = calloc(1, sizeof(struct reader));
+  if (r == NULL)
+    error("ERROR allocating reader");
+  r->fd = fileno(src->fp);
+  r->map = src->map;
+  r->block_size = (uint64_t)READ_BLOCK_PACKETS*src->datasize;
+  r->base = src->base;
+  r->end = src->end;
+  r->n_blocks = (n_packets + READ_BLOCK_PACKETS - 1)/READ_BLOCK_PACKETS;
+  if (r->map == NULL){
+    if (posix_memalign((void **)&r->bufs, 4096, READ_BLOCKS*r->block_size) != 0)
+      error("ERROR allocating read buffers");
+    for (i = 0; i < READ_BLOCKS; i++)
+      r->tags[i] = MAX_ID;
+  }
+  posix_fadvise(r->fd, r->base, (uint64_t)(READ_BLOCKS/2)*r->block_size, POSIX_FADV_WILLNEED);
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_cond_init(&r->wake, NULL);
+  if (pthread_create(&r->thread, NULL, run_reader, r) != 0)
+    error("ERROR starting reader");
+  src->reader = r;
+}
+
+void reader_stop(struct reader *r){
+  pthread_mutex_lock(&r->lock);
+  r->stop = 1;
+  pthread_cond_signal(&r->wake);
+  pthread_mutex_unlock(&r->lock);
+  pthread_join(r->thread, NULL);
+  free(r->bufs);
+  free(r);
+}
+
+/*
+ * Network side of the read-ahead, before each round of sends: tells the
+ * reader which block new sends have reached and lets them go as far as it
+ * has read. Without a reader everything is readable.
+ */
+void read_ahead(struct source *src, struct window *w){
+  struct reader *r = src->reader;
+  uint32_t sending = w->next/READ_BLOCK_PACKETS;
+  uint64_t filled;
+
+  if (r == NULL){
+    w->readable = w->end;
+    return;
+  }
+  if (sending != r->sending){
+    __atomic_store_n(&r->sending, sending, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST)){
+      pthread_mutex_lock(&r->lock);
+      pthread_cond_signal(&r->wake);
+      pthread_mutex_unlock(&r->lock);
+    }
+  }
+  filled = (uint64_t)__atomic_load_n(&r->filled, __ATOMIC_ACQUIRE)*READ_BLOCK_PACKETS;
+  w->readable = filled < w->end ? filled : w->end;
+}
+
+// Whether new sends are held up only by the reader
+int read_stalled(struct window *w){
+  return (w->next == w->readable) && (w->readable < w->end);
+}
+
+/*
+ * The n bytes of the file at offset, for packet packet_id: in the mapping,
+ * in the reader's pool while its block is still there, or else read into
+ * buf. The reader never refills a block less than READ_BLOCKS/2 behind
+ * sending, so one that is tagged and that recent is safe to send from.
+ */
+char *source_data(struct source *src, uint32_t packet_id, uint64_t offset, int n, char *buf){
+  struct reader *r = src->reader;
+  uint32_t b = packet_id/READ_BLOCK_PACKETS;
+
+  if (src->map != NULL)
+    return &src->map[offset];
+  if ((r != NULL) && (b + READ_BLOCKS/2 >= r->sending) && (b < __atomic_load_n(&r->filled, __ATOMIC_ACQUIRE))
+      && (__atomic_load_n(&r->tags[b % READ_BLOCKS], __ATOMIC_RELAXED) == b))
+    return &r->bufs[(b % READ_BLOCKS)*r->block_size + (uint64_t)(packet_id % READ_BLOCK_PACKETS)*src->datasize];
+  if (pread(fileno(src->fp), buf, n, offset) != n)
+    error("ERROR in pread");
+  return buf;
+}
+
+// Whether n bytes are all zero: the first is, and each equals the next
+int all_zero(char *p, int n){
+  return (n > 0) && (p[0] == 0) && (memcmp(p, p + 1, n - 1) == 0);
+}
+
+// Maps the file for sending; falls back to stdio reads if mmap fails
+void open_source(struct source *src, FILE *fp, uint64_t size){
+  src->fp = fp;
+  src->size = size;
+  src->map = NULL;
+  src->codec = CODEC_NONE;
+  src->n_raw = 0;
+  src->n_packed = 0;
+  src->n_zero = 0;
+  src->matches = NULL;
+  src->n_matches = 0;
+  src->hashed = 0;
+  src->reader = NULL;
+  xxh64_init(&src->hash);
+  if ((size == 0) || (size > SIZE_MAX))
+    return;
+  src->map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+  if (src->map == MAP_FAILED){
+    perror("mmap failed, reading with fread instead");
+    src->map = NULL;
+    return;
+  }
+  madvise(src->map, size, MADV_SEQUENTIAL);
+}
+
+void close_source(struct source *src){
+  if (src->reader != NULL)
+    reader_stop(src->reader);
+  if (src->map != NULL)
+    munmap(src->map, src->size);
+  free(src->matches);
+  fclose(src->fp);
+}
+
+/*
+ * Queues packet packet_id as the next datagram in the batch. The id goes in
+ * the batch buffer and the payload iovec points into the mapping, or the
+ * reader's pool, so nothing is copied in user space; failing both the
+ * payload is read into the buffer. A packet of zeros goes out with no
+ * payload at all. With a codec, the payload is compressed or delta-encoded
+ * into the buffer instead if that makes it shorter; the receiver tells them
+ * all apart by length.
+ */
+void queue_packet(struct batch *b, struct source *src, uint32_t packet_id, int sockfd){
+  struct packet *filebuf = &b->bufs[b->len];
+  struct iovec *iov = &b->iov[2*b->len];
+  uint64_t offset = src->base + (uint64_t)packet_id*src->datasize;
+  char buf[MAX_DATASIZE];
+  char *data;
+  int n_read;
+  int n_packed;
+
+  filebuf->id = packet_id;
+  filebuf->session = b->session;
+  filebuf->ts = (uint32_t)now_us();
+  iov[0].iov_base = &filebuf->id;
+  iov[0].iov_len = PKT_HDR;
+  n_read = src->end - offset < src->datasize ? src->end - offset : src->datasize;
+  data = source_data(src, packet_id, offset, n_read, &filebuf->data[0]);
+  iov[1].iov_base = data;
+  iov[1].iov_len = n_read;
+
+  // New packets go out in order, so the content hash keeps up with them from
+  // the payload in hand, before a codec overwrites it; packets a resumed
+  // receiver already had are hashed when passed over
+  if (offset - src->base > src->hashed)
+    hash_upto(&src->hash, &src->hashed, fileno(src->fp), src->map, src->base, offset - src->base);
+  if (offset - src->base == src->hashed){
+    xxh64_update(&src->hash, data, n_read);
+    src->hashed += n_read;
+  }
+  if (all_zero(iov[1].iov_base, n_read)){
+    iov[1].iov_len = 0;
+    src->n_zero++;
+  } else if (src->codec != CODEC_NONE){
+    if (src->codec == CODEC_LZ4)
+      n_packed = lz4_compress(iov[1].iov_base, n_read, buf, n_read - 1);
+    else
+      n_packed = delta_encode(src, offset, iov[1].iov_base, n_read, buf, n_read - 1);
+    if (n_packed > 0){
+      memcpy(&filebuf->data[0], buf, n_packed);
+      iov[1].iov_base = &filebuf->data[0];
+      iov[1].iov_len = n_packed;
+    }
+  }
+  src->n_raw += n_read;
+  src->n_packed += iov[1].iov_len;
+  filebuf->crc = packet_crc(filebuf, iov[1].iov_base, iov[1].iov_len);
+  b->msgs[b->len].msg_hdr.msg_iovlen = 2;
+  batch_queue(b, sockfd);
+}
+
+// (Re)transmits an in-flight packet and stamps its slot in the send window
+void send_window_packet(struct window *w, uint32_t packet_id, struct source *src, struct batch *b, int sockfd){
+  struct slot *s = &w->slots[packet_id % WINDOW];
+
+  queue_packet(b, src, packet_id, sockfd);
+  if (s->sent_us != 0){
+    w->n_retx++;
+    s->retx = 1;
+  }
+  s->lost = 0;
+  s->sent_us = now_us();
+  w->last_sent_us = s->sent_us;
+  s->delivered = w->delivered;
+  s->delivered_us = w->delivered_us;
+}
+
+// Fills in the sending side of a transfer's counters from its window
+void sender_stats(struct stats *st, struct window *w, struct source *src, struct fec *f){
+  st->pkts_sent = (uint64_t)w->next + w->n_retx;
+  st->bytes_sent = src->n_packed;
+  st->retx = w->n_retx;
+  st->repairs = f != NULL ? f->n_sent : 0;
+  st->timeouts = w->n_timeouts;
+  st->tail_probes = w->n_tail_probes;
+  st->rtt_samples = w->n_rtt;
+  st->rtt_sum_us = w->rtt_sum_us;
+}
+
+// Queues an unacknowledged packet for retransmission
+int mark_lost(struct window *w, uint32_t packet_id){
+  struct slot *s = &w->slots[packet_id % WINDOW];
+
+  if (s->acked || s->lost)
+    return 0;
+  s->lost = 1;
+  w->lostq[(w->lostq_head + w->lostq_len) % WINDOW] = packet_id;
+  w->lostq_len++;
+  return 1;
+}
+
+// Folds an RTT sample into the estimate and ends any backoff (RFC 6298)
+void rto_sample(struct rto *r, uint64_t rtt_us){
+  uint64_t err;
+
+  if ((rtt_us == 0) || (rtt_us > MAX_RTO_US)) // garbage, or an echo from another transfer
+    return;
+  if (r->srtt_us == 0){
+    r->srtt_us = rtt_us;
+    r->rttvar_us = rtt_us/2;
+  } else {
+    err = r->srtt_us > rtt_us ? r->srtt_us - rtt_us : rtt_us - r->srtt_us;
+    r->rttvar_us = (3*r->rttvar_us + err)/4;
+    r->srtt_us = (7*r->srtt_us + rtt_us)/8;
+  }
+  r->backoff = 0;
+}
+
+// The current retransmission timeout, backoff included
+uint64_t rto_timeout(struct rto *r){
+  uint64_t rto = INIT_RTO_US;
+
+  if (r->srtt_us != 0){
+    rto = r->srtt_us + (4*r->rttvar_us > RTO_GRANULARITY_US ? 4*r->rttvar_us : RTO_GRANULARITY_US);
+    if (rto < MIN_RTO_US)
+      rto = MIN_RTO_US;
+  }
+  rto <<= r->backoff;
+  return rto < MAX_RTO_US ? rto : MAX_RTO_US;
+}
+
+// Doubles the timeout after an expiry, up to MAX_RTO_US
+void rto_backoff(struct rto *r){
+  if (rto_timeout(r) < MAX_RTO_US)
+    r->backoff++;
+}
+
+// Tail loss probe timeout: two round trips and a delayed ACK, within the RTO
+uint64_t pto_timeout(struct rto *r){
+  uint64_t pto = 2*r->srtt_us + ACK_INTERVAL_US;
+
+  if ((r->srtt_us == 0) || (pto > rto_timeout(r)))
+    return rto_timeout(r);
+  return pto;
+}
+
+// When a tail loss probe is due, or 0 while none is armed: everything has
+// been sent once, nothing waits for retransmission, and no probe is out
+uint64_t tail_probe_at(struct window *w, uint64_t pto, uint64_t last_ack){
+  if (w->tlp_out || (w->lostq_len > 0) || (w->next < w->end) || (w->base >= w->end))
+    return 0;
+  return (w->last_sent_us > last_ack ? w->last_sent_us : last_ack) + pto;
+}
+
+/*
+ * Tail loss probe, after RFC 8985: once the last packets are out and
+ * neither an ACK nor a send has happened for pto, queues the highest
+ * unacknowledged packet for retransmission. Its ACK reveals any loss at the
+ * tail to the usual ACK processing instead of leaving it to the RTO. At
+ * most one probe per ACK that makes progress. Returns 1 if one was queued.
+ */
+int tail_probe(struct window *w, uint64_t pto, uint64_t last_ack, uint64_t now){
+  uint64_t due = tail_probe_at(w, pto, last_ack);
+  uint32_t packet_id;
+
+  if ((due == 0) || (now < due))
+    return 0;
+  w->tlp_out = 1;
+  for (packet_id = w->next; packet_id-- > w->base; ){
+    if (mark_lost(w, packet_id)){
+      w->n_tail_probes++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Chooses the next packet to put on the wire: queued retransmissions first,
+ * then new data while the congestion window has room and the reader has
+ * read it. Returns 0 if nothing may be sent right now.
+ */
+int pick_packet(struct window *w, double cwnd, uint32_t *packet_id){
+  struct slot *s;
+  uint32_t id;
+
+  while (w->lostq_len > 0){
+    id = w->lostq[w->lostq_head];
+    w->lostq_head = (w->lostq_head + 1) % WINDOW;
+    w->lostq_len--;
+    s = &w->slots[id % WINDOW];
+    if ((id >= w->base) && s->lost && !s->acked){
+      *packet_id = id;
+      return 1;
+    }
+  }
+  if ((w->next < w->readable) && (w->next - w->base < WINDOW) && (w->next - w->base - w->n_sacked < cwnd)){
+    *packet_id = w->next++;
+    return 1;
+  }
+  return 0;
+}
+
+int have_packet(struct window *w, double cwnd){
+  return (w->lostq_len > 0) || ((w->next < w->readable) && (w->next - w->base < WINDOW) && (w->next - w->base - w->n_sacked < cwnd));
+}
+
+// Records the delivery of one packet and remembers the newest one delivered
+void deliver_packet(struct window *w, struct slot *s, struct cc_sample *rs, struct slot *newest){
+  rs->acked++;
+  w->delivered++;
+  if (s->sent_us > w->rack_us)
+    w->rack_us = s->sent_us;
+  if (s->sent_us >= newest->sent_us)
+    *newest = *s;
+}
+
+// Marks a packet above the cumulative point as selectively acknowledged
+void sack_packet(struct window *w, uint32_t packet_id, struct cc_sample *rs, struct slot *newest){
+  struct slot *s;
+
+  if ((packet_id < w->base) || (packet_id >= w->next))
+    return;
+  s = &w->slots[packet_id % WINDOW];
+  if (!s->acked){
+    s->acked = 1;
+    s->lost = 0;
+    w->n_sacked++;
+    if (s->sent_us != 0) // not one a resumed receiver already had
+      deliver_packet(w, s, rs, newest);
+  }
+}
+
+/*
+ * How long a hole may trail a delivered packet before it counts as lost: as
+ * in RACK, a quarter of the smoothed RTT but at least REORDER_US. A
+ * duplicate at the receiver, as RACK learns from D-SACK, means a packet was
+ * sent again that had only been held up, so each round trip that brings
+ * new ones widens the window by its base, up to REORDER_MAX_MULT times.
+ * REORDER_RESET ACKs that find losses and no duplicates narrow it back.
+ */
+uint64_t reorder_window(struct window *w, uint64_t srtt_us, uint32_t dups){
+  uint64_t base_us = srtt_us/4 > REORDER_US ? srtt_us/4 : REORDER_US;
+
+  if (w->reorder_mult == 0)
+    w->reorder_mult = 1;
+  if (dups > w->dups){
+    w->dups = dups;
+    w->n_clean = 0;
+    if ((w->reorder_mult < REORDER_MAX_MULT) && (w->reorder_round != w->round_delivered)){
+      w->reorder_mult++;
+      w->reorder_round = w->round_delivered;
+    }
+  }
+  return base_us*w->reorder_mult;
+}
+
+/*
+ * Applies an ACK to the send window. The ACK carries the receiver's cumulative
+ * point (every packet below it has arrived) and describes the packets after
+ * it either as missing ranges or as a bitmap. Holes that were sent more than
+ * the reordering window earlier than a packet known to be delivered are
+ * lost, not just reordered, and all of them are queued for retransmission at
+ * once. The RTT and delivery rate seen by the newest delivered packet go into
+ * rs for the congestion controller, and the RTT to the echoed timestamp for
+ * the RTO. A receiver resuming an interrupted transfer may acknowledge
+ * packets we never sent; the window skips ahead over them, and the ones it
+ * lacks below upto are queued as if lost.
+ */
+void process_ack(struct window *w, struct packet *ack, int n, uint64_t srtt_us, struct cc_sample *rs){
+  struct ack_info *info = (struct ack_info *)&ack->data[0];
+  struct range *ranges = (struct range *)&ack->data[sizeof(struct ack_info)];
+  uint32_t *bits = (uint32_t *)&ack->data[sizeof(struct ack_info)];
+  uint32_t cum = info->cum;
+  uint32_t upto = info->upto;
+  uint32_t sack_high;
+  uint32_t block_end = 0;
+  uint32_t packet_id;
+  uint32_t pos;
+  uint32_t i;
+  uint64_t now = now_us();
+  uint64_t reorder_us;
+  uint32_t dups = w->dups;
+  struct slot *s;
+  struct slot newest;
+
+  bzero(rs, sizeof(*rs));
+  bzero(&newest, sizeof(newest));
+  if ((n < PKT_HDR + (int)sizeof(struct ack_info)) || (upto > w->end) || (upto < cum) || (upto - cum > WINDOW))
+    return;
+  if (info->repaired > w->repaired)
+    w->repaired = info->repaired;
+  reorder_us = reorder_window(w, srtt_us, info->dups);
+  if ((info->format == ACK_RANGES) && ((info->count > MAX_ACK_RANGES) || (n < PKT_HDR + (int)(sizeof(struct ack_info) + info->count*sizeof(struct range)))))
+    return;
+  if ((info->format == ACK_BITMAP) && ((info->count > upto - cum) || (n < PKT_HDR + (int)(sizeof(struct ack_info) + (info->count+31)/32*4))))
+    return;
+
+  // Everything below the cumulative point is delivered; free those slots
+  for (packet_id = w->base; (packet_id < cum) && (packet_id < w->next); packet_id++){
+    s = &w->slots[packet_id % WINDOW];
+    if (s->acked)
+      w->n_sacked--;
+    else if (s->sent_us != 0)
+      deliver_packet(w, s, rs, &newest);
+    bzero(s, sizeof(*s));
+  }
+  if (cum > w->base)
+    w->base = cum;
+  if (cum > w->next){
+    w->next = cum;
+    w->lostq_len = 0; // all stale
+  }
+  while (w->next < upto)
+    mark_lost(w, w->next++);
+
+  // Selectively acknowledged packets above it
+  sack_high = w->base;
+  if (info->format == ACK_RANGES){
+    // Everything in [cum, upto) outside the missing ranges has arrived
+    pos = cum;
+    for (i = 0; i < info->count; i++){
+      if ((ranges[i].start < pos) || (ranges[i].len > upto - ranges[i].start))
+        break;
+      for (packet_id = pos > w->base ? pos : w->base; packet_id < ranges[i].start; packet_id++)
+        sack_packet(w, packet_id, rs, &newest);
+      pos = ranges[i].start + ranges[i].len;
+    }
+    for (packet_id = pos > w->base ? pos : w->base; packet_id < upto; packet_id++)
+      sack_packet(w, packet_id, rs, &newest);
+    if (upto > sack_high)
+      sack_high = upto;
+  } else if (info->format == ACK_BITMAP){
+    for (i = 0; i < info->count; i++){
+      if (TestBit(bits, i)){
+        sack_packet(w, cum + i, rs, &newest);
+        sack_high = cum + i + 1;
+      }
+    }
+  }
+
+  // Queue the holes. With FEC, a first transmission is not lost until a
+  // packet of a later block arrived, since the repair packets sent after
+  // its own block may still rebuild it.
+  for (packet_id = w->base; packet_id < sack_high; packet_id++){
+    s = &w->slots[packet_id % WINDOW];
+    if (w->fec_n > 0)
+      block_end = packet_id - packet_id % w->fec_n + w->fec_n;
+    if (!s->acked && !s->lost && (s->sent_us + reorder_us < w->rack_us)
+        && ((w->fec_n == 0) || s->retx || (block_end < sack_high) || (block_end >= w->end))){
+      if (s->sent_us > rs->lost_sent_us)
+        rs->lost_sent_us = s->sent_us;
+      rs->lost += mark_lost(w, packet_id);
+    }
+  }
+
+  if ((rs->lost > 0) && (w->dups == dups) && (w->reorder_mult > 1) && (++w->n_clean >= REORDER_RESET)){
+    w->reorder_mult = 1;
+    w->n_clean = 0;
+  }
+
+  rs->inflight = w->next - w->base - w->n_sacked;
+  if (rs->acked > 0){
+    if (!newest.retx){
+      rs->rtt_us = now - newest.sent_us;
+      w->n_rtt++;
+      w->rtt_sum_us += rs->rtt_us;
+    }
+    if (now > newest.delivered_us)
+      rs->rate = (w->delivered - newest.delivered)*1e6/(now - newest.delivered_us);
+    if (newest.delivered >= w->round_delivered){
+      w->round_delivered = w->delivered;
+      rs->round_start = 1;
+    }
+    w->delivered_us = now;
+    if (info->ts_echo != 0)
+      rs->echo_us = (uint32_t)((uint32_t)now - info->ts_echo);
+    w->tlp_out = 0;
+  }
+}
+
+// XORs len bytes of src into dst, eight at a time
+void xor_bytes(char *dst, const char *src, int len){
+  uint64_t a;
+  uint64_t b;
+  int i = 0;
+
+  for (; i + 8 <= len; i += 8){
+    memcpy(&a, &dst[i], 8);
+    memcpy(&b, &src[i], 8);
+    a ^= b;
+    memcpy(&dst[i], &a, 8);
+  }
+  for (; i < len; i++)
+    dst[i] ^= src[i];
+}
+
+/*
+ * Repair packets for the next FEC block: one, plus two for each packet per
+ * block the path loses. The loss rate counts the retransmissions FEC did
+ * not prevent and the packets the receiver rebuilt.
+ */
+uint32_t fec_repairs(struct window *w){
+  uint64_t sent = (uint64_t)w->next + w->n_retx;
+  double loss = sent > 0 ? (double)(w->n_retx + w->repaired)/sent : 0;
+  uint32_t k = 1 + (uint32_t)(2*loss*w->fec_n);
+
+  if (k > w->fec_n)
+    k = w->fec_n;
+  return k < FEC_MAX_K ? k : FEC_MAX_K;
+}
+
+/*
+ * Queues the repair packets of the FEC block that packet_id completes, if it
+ * is a first transmission that completes one, and returns how many. Lane j
+ * XORs every k-th packet of the block from the j-th on, so the receiver can
+ * rebuild one missing packet per lane without a round trip.
+ */
+int send_repairs(struct fec *f, struct window *w, struct source *src, uint32_t packet_id, struct batch *b, int sockfd){
+  struct packet *pkt;
+  struct repair_info *r;
+  struct iovec *iov;
+  char buf[MAX_DATASIZE];
+  char *data;
+  uint64_t offset;
+  uint32_t first;
+  uint32_t id;
+  uint32_t k;
+  uint32_t j;
+  int len = sizeof(struct repair_info) + src->datasize;
+  int n_read;
+
+  if ((f == NULL) || w->slots[packet_id % WINDOW].retx || (((packet_id + 1) % w->fec_n != 0) && (packet_id + 1 != w->end)))
+    return 0;
+  first = packet_id - packet_id % w->fec_n;
+  k = fec_repairs(w);
+  if (k > packet_id + 1 - first)
+    k = packet_id + 1 - first;
+
+  // The previous block's repair packets may still be queued
+  batch_flush(b, sockfd);
+  for (j = 0; j < k; j++)
+    bzero(&f->pkts[j], PKT_HDR + len);
+  for (id = first; id <= packet_id; id++){
+    offset = src->base + (uint64_t)id*src->datasize;
+    n_read = src->end - offset < src->datasize ? src->end - offset : src->datasize;
+    data = source_data(src, id, offset, n_read, buf);
+    xor_bytes(&f->pkts[(id - first) % k].data[sizeof(struct repair_info)], data, n_read);
+  }
+  for (j = 0; j < k; j++){
+    pkt = &f->pkts[j];
+    r = (struct repair_info *)&pkt->data[0];
+    pkt->id = REPAIR_ID;
+    pkt->session = b->session;
+    pkt->ts = (uint32_t)now_us();
+    r->first = first;
+    r->n = packet_id + 1 - first;
+    r->lane = j;
+    r->k = k;
+    pkt->crc = packet_crc(pkt, &pkt->data[0], len);
+    iov = &b->iov[2*b->len];
+    iov[0].iov_base = &pkt->id;
+    iov[0].iov_len = PKT_HDR;
+    iov[1].iov_base = &pkt->data[0];
+    iov[1].iov_len = len;
+    b->msgs[b->len].msg_hdr.msg_iovlen = 2;
+    batch_queue(b, sockfd);
+  }
+  f->n_sent += k;
+  return k;
+}
+
+// Bytes in packet packet_id of the transfer info describes
+int packet_len(struct header_info *info, uint32_t packet_id){
+  uint64_t offset = (uint64_t)packet_id*info->datasize;
+
+  return info->stripe_bytes - offset < info->datasize ? info->stripe_bytes - offset : info->datasize;
+}
+
+// The buffer for the next job's payload, or NULL if the queue is full
+char *writer_buffer(struct writer *w){
+  if (w->tail - __atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == WRITE_SLOTS)
+    return NULL;
+  return &w->bufs[(w->tail % WRITE_SLOTS)*w->slot_size];
+}
+
+// Queues a write of len bytes, already in writer_buffer, or a checkpoint.
+// The writer only looks for it after writer_kick.
+void writer_queue(struct writer *w, int fd, off_t offset, int len, int hole, struct stats *st, struct checkpoint *cp){
+  struct write_job *job = &w->jobs[w->tail % WRITE_SLOTS];
+
+  job->fd = fd;
+  job->offset = offset;
+  job->len = len;
+  job->data = &w->bufs[(w->tail % WRITE_SLOTS)*w->slot_size];
+  job->hole = hole;
+  job->st = st;
+  job->cp = cp;
+  __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_SEQ_CST);
+}
+
+// Wakes the writer if it sleeps, once per batch of received packets
+void writer_kick(struct writer *w){
+  if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)){
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->wake);
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+// Waits until every queued job is done, before reading the file back
+void writer_drain(struct writer *w){
+  writer_kick(w);
+  pthread_mutex_lock(&w->lock);
+  __atomic_store_n(&w->draining, 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) != w->tail)
+    pthread_cond_wait(&w->idle, &w->lock);
+  __atomic_store_n(&w->draining, 0, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/*
+ * How far the file is written without waiting: packets below the returned
+ * point are in the file, not just queued. m remembers cum and the end of
+ * the queue at one moment; once the writer gets there, that cum is written
+ * and m moves on to the current ones.
+ */
+uint32_t written_upto(struct writer *w, struct write_mark *m, uint32_t cum){
+  if (__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) >= m->ticket){
+    m->written = m->cum;
+    m->cum = cum;
+    m->ticket = w->tail;
+  }
+  return m->written;
+}
+
+void recvmap_free(struct recvmap *m){
+  free(m->bits);
+  free(m->full);
+  free(m->full2);
+  m->bits = NULL;
+  m->full = NULL;
+  m->full2 = NULL;
+}
+
+// Records that word w of the bits is full, and so maybe a word of full
+void recvmap_full(struct recvmap *m, uint64_t w){
+  m->full[w/64] |= 1ull << (w % 64);
+  if (m->full[w/64] == ~0ull)
+    m->full2[w/4096] |= 1ull << (w/64 % 64);
+}
+
+/*
+ * Sizes the bitmap for n_packets, none of them arrived. Each level gets a
+ * spare word of ones, so scans can look one word past the end. Returns -1
+ * if there is not enough memory.
+ */
+int recvmap_alloc(struct recvmap *m, uint32_t n_packets){
+  uint64_t i;
+
+  m->n_packets = n_packets;
+  m->count = 0;
+  m->len = ((uint64_t)n_packets + 31)/32;
+  m->len1 = (m->len + 63)/64;
+  m->len2 = (m->len1 + 63)/64;
+  m->bits = calloc(m->len + 1, sizeof(uint32_t));
+  m->full = calloc(m->len1 + 1, sizeof(uint64_t));
+  m->full2 = calloc(m->len2 + 1, sizeof(uint64_t));
+  if ((m->bits == NULL) || (m->full == NULL) || (m->full2 == NULL)){
+    recvmap_free(m);
+    return -1;
+  }
+  m->bits[m->len] = ~0u;
+  m->full[m->len1] = ~0ull;
+  m->full2[m->len2] = ~0ull;
+  for (i = n_packets; i < m->len*32; i++)
+    m->bits[i/32] |= 1u << (i % 32);
+  for (i = m->len; i < m->len1*64; i++)
+    recvmap_full(m, i);
+  for (i = m->len1; i < m->len2*64; i++)
+    m->full2[i/64] |= 1ull << (i % 64);
+  return 0;
+}
+
+int recvmap_has(struct recvmap *m, uint32_t id){
+  return (m->bits[id/32] >> (id % 32)) & 1;
+}
+
+// Marks packet id arrived; returns 0 if it already had
+int recvmap_set(struct recvmap *m, uint32_t id){
+  uint64_t w = id/32;
+
+  if (m->bits[w] & (1u << (id % 32)))
+    return 0;
+  m->bits[w] |= 1u << (id % 32);
+  m->count++;
+  if (m->bits[w] == ~0u)
+    recvmap_full(m, w);
+  return 1;
+}
+
+int recvmap_complete(struct recvmap *m){
+  return m->count == m->n_packets;
+}
+
+/*
+ * First packet at or after from that has not arrived, or limit if there is
+ * none below limit. Climbs the summaries past full words and comes back
+ * down with one count of trailing zeros per level, so a run of any length
+ * costs at most a few words, plus a scan of full2 for runs of millions.
+ */
+uint32_t recvmap_missing(struct recvmap *m, uint32_t from, uint32_t limit){
+  uint64_t w = from/32;
+  uint64_t j;
+  uint64_t k;
+  uint64_t x;
+  uint64_t id;
+
+  if (from >= limit)
+    return limit;
+  x = (uint32_t)(~m->bits[w] & (~0u << (from % 32)));
+  if (x == 0){
+    w++;
+    j = w/64;
+    x = ~m->full[j] & (~0ull << (w % 64));
+    if (x == 0){
+      j++;
+      k = j/64;
+      x = ~m->full2[k] & (~0ull << (j % 64));
+      while ((x == 0) && (++k < m->len2))
+        x = ~m->full2[k];
+      if (x == 0)
+        return limit;
+      j = k*64 + __builtin_ctzll(x);
+      x = ~m->full[j];
+    }
+    w = j*64 + __builtin_ctzll(x);
+    x = (uint32_t)~m->bits[w];
+  }
+  id = w*32 + __builtin_ctzll(x);
+  return id < limit ? id : limit;
+}
+
+// First packet at or after from that has arrived, or limit if there is none
+// below limit, a word at a time
+uint32_t recvmap_present(struct recvmap *m, uint32_t from, uint32_t limit){
+  uint64_t w = from/32;
+  uint64_t id;
+  uint32_t x;
+
+  if (from >= limit)
+    return limit;
+  x = m->bits[w] & (~0u << (from % 32));
+  while ((x == 0) && (++w*32 < limit))
+    x = m->bits[w];
+  if (x == 0)
+    return limit;
+  id = w*32 + __builtin_ctz(x);
+  return id < limit ? id : limit;
+}
+
+// The 32 bits of the bitmap from packet id on
+uint32_t recvmap_word(struct recvmap *m, uint32_t id){
+  uint32_t x = m->bits[id/32] >> (id % 32);
+
+  if (id % 32 != 0)
+    x |= m->bits[id/32 + 1] << (32 - id % 32);
+  return x;
+}
+
+void fec_store_free(struct fec_store *f){
+  free(f->bufs);
+  free(f->tags);
+  f->bufs = NULL;
+  f->tags = NULL;
+  f->n_slots = 0;
+}
+
+// Sizes the store from the header: two of the sender's FEC blocks
+int fec_store_alloc(struct fec_store *f, struct header_info *info){
+  uint32_t i;
+
+  f->n_slots = 2*info->fec_block;
+  f->datasize = info->datasize;
+  f->bufs = NULL;
+  f->tags = NULL;
+  if (f->n_slots == 0)
+    return 0;
+  f->bufs = malloc((uint64_t)f->n_slots*f->datasize);
+  f->tags = malloc(f->n_slots*sizeof(uint32_t));
+  if ((f->bufs == NULL) || (f->tags == NULL)){
+    fec_store_free(f);
+    return -1;
+  }
+  for (i = 0; i < f->n_slots; i++)
+    f->tags[i] = MAX_ID;
+  return 0;
+}
+
+// Keeps the decoded payload of a packet for rebuilding its lane
+void fec_keep(struct fec_store *f, uint32_t packet_id, const char *data, int len){
+  uint32_t slot;
+
+  if (f->n_slots == 0)
+    return;
+  slot = packet_id % f->n_slots;
+  memcpy(&f->bufs[(uint64_t)slot*f->datasize], data, len);
+  f->tags[slot] = packet_id;
+}
+
+/*
+ * Rebuilds the one packet missing from the lane of an FEC block that repair
+ * packet pkt covers, from the parity and the lane's other packets, which fs
+ * kept. Queues it and marks it received. Returns 1 with its ID if a packet
+ * was rebuilt, 0 if the lane is complete, lacks more than one or was not
+ * kept.
+ */
+int rebuild_packet(struct writer *w, struct fec_store *fs, struct packet *pkt, int n, int fd, struct header_info *info, struct recvmap *recvmap, uint32_t cum, uint32_t *packet_id, struct stats *st){
+  struct repair_info *r = (struct repair_info *)&pkt->data[0];
+  char *parity = &pkt->data[sizeof(struct repair_info)];
+  char *buf;
+  uint32_t missing = 0;
+  uint32_t n_missing = 0;
+  uint32_t id;
+  int len;
+
+  if ((n != PKT_HDR + (int)(sizeof(struct repair_info) + info->datasize)) || (pkt->crc != packet_crc(pkt, &pkt->data[0], n - PKT_HDR)))
+    return 0;
+  if ((fs->n_slots == 0) || (r->k == 0) || (r->lane >= r->k) || (r->first >= info->n_packets) || (r->n > info->n_packets - r->first) || (r->first + r->n <= cum))
+    return 0;
+  for (id = r->first + r->lane; id < r->first + r->n; id += r->k){
+    if (!recvmap_has(recvmap, id)){
+      missing = id;
+      n_missing++;
+    }
+  }
+  if ((n_missing != 1) || (missing >= cum + WINDOW))
+    return 0;
+
+  // The other packets of the lane must still be kept; ones that are not,
+  // such as those written before a resume, leave the loss to retransmission
+  for (id = r->first + r->lane; id < r->first + r->n; id += r->k){
+    if ((id != missing) && (fs->tags[id % fs->n_slots] != id))
+      return 0;
+  }
+  buf = writer_buffer(w);
+  if (buf == NULL){
+    st->write_drops++;
+    return 0;
+  }
+  for (id = r->first + r->lane; id < r->first + r->n; id += r->k){
+    if (id != missing)
+      xor_bytes(parity, &fs->bufs[(uint64_t)(id % fs->n_slots)*fs->datasize], packet_len(info, id));
+  }
+  len = packet_len(info, missing);
+  memcpy(buf, parity, len);
+  fec_keep(fs, missing, buf, len);
+  writer_queue(w, fd, info->stripe_offset + (off_t)missing*info->datasize, len, 0, st, NULL);
+  recvmap_set(recvmap, missing);
+  *packet_id = missing;
+  return 1;
+}
+
+/*
+ * Queues data packet packet_id for writing to the file, decompressing it
+ * first if the sender compressed it, which it shows by sending fewer bytes
+ * than the packet holds. An empty payload stands for a packet of zeros,
+ * which the writer turns into a hole. Delta-encoded packets copy from
+ * base_fd, the old copy of the file. The payload is decoded straight into
+ * the writer's buffer. Returns 0 if the payload does not decode to the packet, and -1 if
+ * the queue is full, in which case the packet is dropped and counted in st
+ * and the sender repairs it like a lost one.
+ */
+int write_packet(struct writer *w, struct fec_store *fs, int fd, int base_fd, struct header_info *info, uint32_t packet_id, char *data, int len, struct stats *st){
+  char *buf = writer_buffer(w);
+  int want = packet_len(info, packet_id);
+
+  if (buf == NULL){
+    st->write_drops++;
+    return -1;
+  }
+  if (len == 0){
+    bzero(buf, want);
+    fec_keep(fs, packet_id, buf, want);
+    writer_queue(w, fd, info->stripe_offset + (off_t)packet_id*info->datasize, want, 1, st, NULL);
+    return 1;
+  }
+  if ((len < want) && (info->codec != CODEC_NONE)){
+    if (info->codec == CODEC_LZ4 ? lz4_decompress(data, len, buf, want) != want : delta_decode(base_fd, data, len, buf, want) != want)
+      return 0;
+    len = want;
+  } else {
+    memcpy(buf, data, len);
+  }
+  fec_keep(fs, packet_id, buf, len);
+  writer_queue(w, fd, info->stripe_offset + (off_t)packet_id*info->datasize, len, 0, st, NULL);
+  return 1;
+}
+
+/*
+ * Sizes the file from the header and reserves the blocks of the stripe in
+ * one piece, so packets arriving out of order do not fragment it. Runs of
+ * zero packets punch holes in the reservation later.
+ */
+void size_file(int fd, struct header_info *info){
+  if (ftruncate(fd, info->file_bytes) < 0)
+    perror("ERROR in ftruncate");
+  if ((info->stripe_bytes > 0) && (fallocate(fd, 0, info->stripe_offset, info->stripe_bytes) < 0) && (errno != EOPNOTSUPP))
+    perror("ERROR in fallocate");
+}
+
+/*
+ * Bytes [*offset, *offset + *len) of stripe stripe out of n_stripes. Stripes
+ * are cut at page boundaries, so no two of them write the same page.
+ */
+void stripe_range(uint64_t file_bytes, int stripe, int n_stripes, uint64_t *offset, uint64_t *len){
+  uint64_t per = ((file_bytes + n_stripes - 1)/n_stripes + STRIPE_ALIGN - 1)/STRIPE_ALIGN*STRIPE_ALIGN;
+
+  *offset = stripe*per < file_bytes ? stripe*per : file_bytes;
+  *len = file_bytes - *offset < per ? file_bytes - *offset : per;
+}
+
+// Fills in a header and returns its length in bytes
+int build_header(struct packet *header, uint32_t session, struct source *src, uint32_t n_packets, uint32_t fec_n, uint32_t flags){
+  struct header_info *info = (struct header_info *)&header->data[0];
+
+  bzero(header, BUFSIZE);
+  header->id = n_packets; // never a data packet ID
+  header->session = session;
+  memcpy(info->magic, HEADER_MAGIC, sizeof(info->magic));
+  info->version = HEADER_VERSION;
+  info->file_bytes = src->size;
+  info->mtime = src->mtime;
+  info->stripe_offset = src->base;
+  info->stripe_bytes = src->end - src->base;
+  info->n_packets = n_packets;
+  info->datasize = src->datasize;
+  info->codec = src->codec;
+  info->flags = flags;
+  info->fec_block = fec_n;
+  return PKT_HDR + sizeof(struct header_info);
+}
+
+/*
+ * Checks a received header and copies it to out. The header comes from the
+ * network, so a packet size we cannot receive, a stripe outside the file, or
+ * a count that does not match the size or runs into the reserved IDs is
+ * rejected rather than trusted.
+ */
+int parse_header(struct packet *header, int n, struct header_info *out){
+  struct header_info *info = (struct header_info *)&header->data[0];
+
+  if ((n < PKT_HDR + (int)sizeof(struct header_info)) || (strncmp(header->data, HEADER_MAGIC, 15) != 0))
+    return 0;
+  if (info->version != HEADER_VERSION)
+    return 0;
+  if ((info->datasize < DATASIZE) || (info->datasize > MAX_DATASIZE) || (info->fec_block > FEC_MAX_BLOCK))
+    return 0;
+  if ((info->stripe_offset > info->file_bytes) || (info->stripe_bytes > info->file_bytes - info->stripe_offset))
+    return 0;
+  if (info->n_packets != (info->stripe_bytes + info->datasize - 1)/info->datasize)
+    return 0;
+  memcpy(out, info, sizeof(*out));
+  return out->n_packets < MAX_PACKETS;
+}
+
+// Where the receiver of bytes from offset on of fname keeps its checkpoint:
+// a hidden ".name.offset.resume" next to the file
+void checkpoint_path(char *path, size_t size, char *fname, uint64_t offset){
+  char *slash = strrchr(fname, '/');
+  int dirlen = slash == NULL ? 0 : slash - fname + 1;
+
+  snprintf(path, size, "%.*s.%s.%llu.resume", dirlen, fname, &fname[dirlen], (unsigned long long)offset);
+}
+
+/*
+ * Saves the receive bitmap, tagged with the transfer it belongs to, so an
+ * interrupted transfer can resume. The data is synced first, so the bitmap
+ * never claims packets that are not on disk, and the checkpoint is written
+ * to a temporary file and renamed, so a crash leaves the old one intact.
+ */
+void save_checkpoint(char *fname, int fd, struct header_info *info, uint32_t *recvmap, uint64_t recvmap_len){
+  struct header_info cp = *info;
+  char path[192];
+  char tmp[200];
+  int cfd;
+
+  if (fdatasync(fd) < 0){
+    perror("ERROR in fdatasync");
+    return;
+  }
+  checkpoint_path(path, sizeof(path), fname, info->stripe_offset);
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  memcpy(cp.magic, CHECKPOINT_MAGIC, sizeof(cp.magic));
+  cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (cfd < 0){
+    perror("ERROR opening checkpoint");
+    return;
+  }
+  if ((write(cfd, &cp, sizeof(cp)) != sizeof(cp)) || (write(cfd, recvmap, recvmap_len*4) != (ssize_t)(recvmap_len*4)) || (fdatasync(cfd) < 0)){
+    perror("ERROR writing checkpoint");
+    close(cfd);
+    unlink(tmp);
+    return;
+  }
+  close(cfd);
+  if (rename(tmp, path) < 0)
+    perror("ERROR in rename");
+}
+
+/*
+ * Restores the bitmap of an earlier attempt at the same transfer: same file
+ * size, modification time and stripe, with the partial file still in place.
+ * Probing may have settled on another packet size this time, so a packet
+ * counts as received if every old packet overlapping it was. Sets the
+ * cumulative point and highest packet to resume from, and returns how many
+ * packets were restored.
+ */
+uint32_t load_checkpoint(char *fname, int fd, struct header_info *info, struct recvmap *recvmap, uint32_t *cum, uint32_t *highest){
+  struct header_info cp;
+  struct stat st;
+  char path[192];
+  uint32_t *old;
+  uint64_t old_len;
+  uint64_t start;
+  uint64_t stop;
+  uint64_t k;
+  uint32_t n = 0;
+  uint32_t i;
+  int cfd;
+
+  *cum = 0;
+  *highest = 0;
+  checkpoint_path(path, sizeof(path), fname, info->stripe_offset);
+  cfd = open(path, O_RDONLY);
+  if (cfd < 0)
+    return 0;
+  if ((read(cfd, &cp, sizeof(cp)) != sizeof(cp)) || (strncmp(cp.magic, CHECKPOINT_MAGIC, 15) != 0) || (cp.version != HEADER_VERSION)
+      || (cp.file_bytes != info->file_bytes) || (cp.mtime != info->mtime) || (cp.stripe_offset != info->stripe_offset) || (cp.stripe_bytes != info->stripe_bytes)
+      || (cp.datasize < DATASIZE) || (cp.datasize > MAX_DATASIZE) || (cp.n_packets != (cp.stripe_bytes + cp.datasize - 1)/cp.datasize)
+      || (fstat(fd, &st) < 0) || ((uint64_t)st.st_size != info->file_bytes)){
+    close(cfd);
+    return 0;
+  }
+  old_len = ((uint64_t)cp.n_packets + 31)/32;
+  old = malloc(old_len*4 + 4);
+  if ((old == NULL) || (read(cfd, old, old_len*4) != (ssize_t)(old_len*4))){
+    free(old);
+    close(cfd);
+    return 0;
+  }
+  close(cfd);
+
+  for (i = 0; i < info->n_packets; i++){
+    start = (uint64_t)i*info->datasize;
+    stop = start + info->datasize < info->stripe_bytes ? start + info->datasize : info->stripe_bytes;
+    for (k = start/cp.datasize; (k*cp.datasize < stop) && TestBit(old, k); k++)
+      ;
+    if (k*cp.datasize >= stop)
+      n += recvmap_set(recvmap, i);
+  }
+  free(old);
+
+  // The receiver only accepts packets within WINDOW of the cumulative point
+  *cum = recvmap_missing(recvmap, 0, info->n_packets);
+  for (i = *cum; (i < info->n_packets) && (i < *cum + WINDOW); i++){
+    if (recvmap_has(recvmap, i))
+      *highest = i + 1;
+  }
+  if (*highest < *cum)
+    *highest = *cum;
+  return n;
+}
+
+// Receiver side: hashes the bytes below the cumulative point once a
+// HASH_CHUNK of them has piled up
+void hash_received(struct xxh64 *h, uint64_t *hashed, int fd, struct header_info *info, uint32_t cum){
+  uint64_t upto = (uint64_t)cum*info->datasize;
+
+  if (upto > info->stripe_bytes)
+    upto = info->stripe_bytes;
+  if (upto >= *hashed + HASH_CHUNK)
+    hash_upto(h, hashed, fd, NULL, info->stripe_offset, upto);
+}
+
+// Receiver side: finishes the content hash of a complete stripe and checks
+// it against the digest the sender put after the EOF marker
+int hash_matches(struct xxh64 *h, uint64_t *hashed, int fd, struct header_info *info, struct packet *eof, int n){
+  uint64_t digest;
+
+  if (n < PKT_HDR + (int)strlen(EOF_MARKER) + (int)sizeof(digest))
+    return 0;
+  hash_upto(h, hashed, fd, NULL, info->stripe_offset, info->stripe_bytes);
+  memcpy(&digest, &eof->data[strlen(EOF_MARKER)], sizeof(digest));
+  return xxh64_digest(h) == digest;
+}
+
+// Drops the checkpoint of a transfer that completed
+void remove_checkpoint(char *fname, uint64_t offset){
+  char path[192];
+
+  checkpoint_path(path, sizeof(path), fname, offset);
+  unlink(path);
+}
+
+// Queues a checkpoint behind the packets already queued, so it never claims
+// one that is not in the file yet. Returns 0 if the queue is full.
+int queue_checkpoint(struct writer *w, char *fname, int fd, struct header_info *info, uint32_t *recvmap, uint64_t recvmap_len){
+  struct checkpoint *cp;
+
+  if (writer_buffer(w) == NULL)
+    return 0;
+  cp = malloc(sizeof(*cp) + recvmap_len*4);
+  if (cp == NULL)
+    return 0;
+  snprintf(cp->fname, sizeof(cp->fname), "%s", fname);
+  cp->fd = fd;
+  cp->info = *info;
+  cp->recvmap_len = recvmap_len;
+  memcpy(cp->recvmap, recvmap, recvmap_len*4);
+  writer_queue(w, fd, 0, 0, 0, NULL, cp);
+  return 1;
+}
+
+// Counts a write and its latency; the network thread reads these meanwhile
+void count_write(struct stats *st, uint64_t took){
+  uint64_t max = __atomic_load_n(&st->write_max_us, __ATOMIC_RELAXED);
+
+  __atomic_fetch_add(&st->writes, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&st->write_us, took, __ATOMIC_RELAXED);
+  while ((took > max) && !__atomic_compare_exchange_n(&st->write_max_us, &max, took, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    ;
+}
+
+/*
+ * Punches one hole for the run of zero packets that starts at job head, up
+ * to tail. Returns how many jobs it did, or 0 if the file system cannot
+ * punch holes, in which case their zeros are written like any data.
+ */
+int punch_holes(struct writer *w, uint64_t head, uint64_t tail){
+  struct write_job *job = &w->jobs[head % WRITE_SLOTS];
+  struct write_job *next;
+  uint64_t start;
+  off_t end = job->offset;
+  int n;
+
+  for (n = 0; head + n < tail; n++){
+    next = &w->jobs[(head + n) % WRITE_SLOTS];
+    if ((next->cp != NULL) || !next->hole || (next->fd != job->fd) || (next->offset != end))
+      break;
+    end += next->len;
+  }
+  start = now_us();
+  if (fallocate(job->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, job->offset, end - job->offset) < 0)
+    return 0;
+  count_write(job->st, now_us() - start);
+  return n;
+}
+
+// The writer thread: does the jobs in order, merging runs of packets
+void *run_writer(void *arg){
+  struct writer *w = arg;
+  struct iovec iov[WRITE_MAX_IOV];
+  struct write_job *job;
+  struct write_job *next;
+  sigset_t all;
+  uint64_t head = 0;
+  uint64_t tail;
+  uint64_t start;
+  off_t end;
+  int n;
+
+  // Signals are for the network threads
+  sigfillset(&all);
+  pthread_sigmask(SIG_BLOCK, &all, NULL);
+  while (1){
+    tail = __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+    if (head == tail){
+      // Sleep; the network thread only signals if it sees sleeping set, so
+      // it is set before the last look at tail
+      pthread_mutex_lock(&w->lock);
+      __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+      while ((__atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) == head) && !w->stop)
+        pthread_cond_wait(&w->wake, &w->lock);
+      __atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+      n = w->stop && (__atomic_load_n(&w->tail, __ATOMIC_SEQ_CST) == head);
+      pthread_mutex_unlock(&w->lock);
+      if (n)
+        return NULL;
+      continue;
+    }
+
+    job = &w->jobs[head % WRITE_SLOTS];
+    if (job->cp != NULL){
+      save_checkpoint(job->cp->fname, job->cp->fd, &job->cp->info, job->cp->recvmap, job->cp->recvmap_len);
+      free(job->cp);
+      n = 1;
+    } else if (!job->hole || ((n = punch_holes(w, head, tail)) == 0)){
+      end = job->offset;
+      for (n = 0; (n < WRITE_MAX_IOV) && (head + n < tail); n++){
+        next = &w->jobs[(head + n) % WRITE_SLOTS];
+        if ((next->cp != NULL) || (next->fd != job->fd) || (next->offset != end))
+          break;
+        iov[n].iov_base = next->data;
+        iov[n].iov_len = next->len;
+        end += next->len;
+      }
+      start = now_us();
+      if (pwritev(job->fd, iov, n, job->offset) < 0)
+        perror("ERROR in pwritev");
+      count_write(job->st, now_us() - start);
+    }
+
+    // Free the jobs, and wake a network thread waiting for the queue to drain
+    head += n;
+    __atomic_store_n(&w->head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&w->draining, __ATOMIC_SEQ_CST)){
+      pthread_mutex_lock(&w->lock);
+      pthread_cond_broadcast(&w->idle);
+      pthread_mutex_unlock(&w->lock);
+    }
+  }
+}
+
+// Starts a writer whose packets hold up to slot_size bytes
+void writer_start(struct writer *w, int slot_size){
+  bzero(w, sizeof(*w));
+  w->slot_size = slot_size;
+  w->bufs = malloc((size_t)WRITE_SLOTS*slot_size);
+  if (w->bufs == NULL)
+    error("ERROR allocating write buffers");
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->wake, NULL);
+  pthread_cond_init(&w->idle, NULL);
+  if (pthread_create(&w->thread, NULL, run_writer, w) != 0)
+    error("ERROR starting writer");
+}
+
+// Finishes the queued jobs and stops the writer
+void writer_stop(struct writer *w){
+  pthread_mutex_lock(&w->lock);
+  w->stop = 1;
+  pthread_cond_signal(&w->wake);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, NULL);
+  free(w->bufs);
+  w->bufs = NULL;
+}
+
+// Datagram sizes tried by path MTU probing, largest first: the IPv4
+// payloads of 9000, 8000, 4000 and 1500 byte MTUs
+int probe_sizes[] = {MAX_BUFSIZE, 8000 - 28, 4000 - 28, 1500 - 28, 0};
+
+/*
+ * Sends one round of path MTU probes, one datagram of each size, with the
+ * don't-fragment bit set on the socket. A datagram the path cannot carry is
+ * dropped on the way, or refused right here if it exceeds our own MTU.
+ */
+void send_probes(struct probe *p, int sockfd, uint32_t session, const struct sockaddr *addr, socklen_t addrlen){
+  struct packet probe;
+  int i;
+
+  bzero(&probe, sizeof(probe));
+  probe.id = PROBE_ID;
+  probe.session = session;
+  for (i = 0; probe_sizes[i] != 0; i++){
+    memcpy(&probe.data[0], &probe_sizes[i], sizeof(probe_sizes[i]));
+    if ((sendto(sockfd, &probe, probe_sizes[i], 0, addr, addrlen) < 0) && (errno != EMSGSIZE) && (errno != EAGAIN))
+      error("ERROR in sendto");
+  }
+  if (p->tries > 0)
+    p->timeout_us *= 2;
+  p->tries++;
+  p->sent_us = now_us();
+}
+
+// Receiver side: reports the size of a probe that made it through. The echo
+// is small, so only the path the data will take is measured.
+void echo_probe(int sockfd, struct packet *pkt, int n, const struct sockaddr *addr, socklen_t addrlen){
+  struct packet echo;
+  int32_t size = n;
+
+  bzero(&echo, PKT_HDR + sizeof(size));
+  echo.id = PROBE_ID;
+  echo.session = pkt->session;
+  memcpy(&echo.data[0], &size, sizeof(size));
+  if ((sendto(sockfd, &echo, PKT_HDR + sizeof(size), 0, addr, addrlen) < 0) && (errno != EAGAIN))
+    error("ERROR in sendto");
+}
+
+// Records an echo. The probes of a round go out together, so once one is
+// echoed, larger ones get about one more round trip to show up. An echo of
+// the first round is also an RTT sample; a later one might answer any round.
+void probe_reply(struct probe *p, struct packet *pkt, int n, uint64_t now){
+  int32_t size;
+
+  if (n < PKT_HDR + (int)sizeof(size))
+    return;
+  memcpy(&size, &pkt->data[0], sizeof(size));
+  if ((size <= p->best) || (size < BUFSIZE) || (size > MAX_BUFSIZE))
+    return;
+  p->best = size;
+  if (p->done_us == 0){
+    p->done_us = now + 2*(now - p->sent_us) + PROBE_SLACK_US;
+    if (p->tries == 1)
+      p->rtt_us = now - p->sent_us;
+  }
+}
+
+/*
+ * Advances the search: sends a round of probes when one is due and returns
+ * the payload size to use, or 0 while still waiting for echoes. If no probe
+ * gets through the transfer falls back to BUFSIZE datagrams. The caller sets
+ * timeout_us from its RTO.
+ */
+uint32_t run_probe(struct probe *p, int sockfd, uint32_t session, const struct sockaddr *addr, socklen_t addrlen, uint64_t now){
+  if ((p->best == probe_sizes[0]) || ((p->done_us != 0) && (now >= p->done_us)))
+    return p->best - PKT_HDR;
+  if ((p->tries > 0) && (now < p->sent_us + p->timeout_us))
+    return 0;
+  if (p->tries == PROBE_TRIES)
+    return DATASIZE;
+  send_probes(p, sockfd, session, addr, addrlen);
+  return 0;
+}
+
+// When run_probe next has something to do
+uint64_t probe_deadline(struct probe *p){
+  if (p->done_us != 0)
+    return p->done_us;
+  return p->sent_us + p->timeout_us;
+}
+
+/*
+ * Builds an ACK for the receiver's current state, with the FEC rebuild count
+ * from st and the timestamp to echo, and sends it, counting it in st. Above the
+ * cumulative point it lists the missing ranges, so a hole of any size costs
+ * 8 bytes, unless a bitmap describes more packets or the same packets in
+ * fewer bytes, which is the case when many scattered single packets are
+ * missing.
+ */
+void send_ack(int sockfd, uint32_t session, struct recvmap *recvmap, uint32_t cum, uint32_t highest, uint32_t ts_echo, struct stats *st, const struct sockaddr *addr, socklen_t addrlen){
+  struct packet ack;
+  struct ack_info *info = (struct ack_info *)&ack.data[0];
+  struct range ranges[MAX_ACK_RANGES];
+  uint32_t *bits = (uint32_t *)&ack.data[sizeof(struct ack_info)];
+  uint32_t n_ranges = 0;
+  uint32_t ranges_upto;
+  uint32_t nbits;
+  uint32_t packet_id;
+  uint32_t i;
+  int len;
+
+  bzero(&ack, BUFSIZE);
+  ack.id = ACK_ID;
+  ack.session = session;
+  info->cum = cum;
+  info->repaired = st->repaired;
+  info->ts_echo = ts_echo;
+  info->dups = st->dups;
+  if (highest < cum)
+    highest = cum;
+  st->acks++;
+  if (highest > cum)
+    st->nacks++;
+
+  // Missing ranges, up to as many as fit
+  ranges_upto = highest;
+  packet_id = recvmap_missing(recvmap, cum, highest);
+  while (packet_id < highest){
+    if (n_ranges == MAX_ACK_RANGES){
+      ranges_upto = packet_id;
+      break;
+    }
+    ranges[n_ranges].start = packet_id;
+    packet_id = recvmap_present(recvmap, packet_id, highest);
+    ranges[n_ranges].len = packet_id - ranges[n_ranges].start;
+    n_ranges++;
+    packet_id = recvmap_missing(recvmap, packet_id, highest);
+  }
+
+  nbits = highest - cum < MAX_ACK_BITS ? highest - cum : MAX_ACK_BITS;
+  if ((ranges_upto - cum > nbits) || ((ranges_upto - cum == nbits) && (n_ranges*sizeof(struct range) <= (nbits+31)/32*4))){
+    info->format = ACK_RANGES;
+    info->upto = ranges_upto;
+    info->count = n_ranges;
+    memcpy(&ack.data[sizeof(struct ack_info)], ranges, n_ranges*sizeof(struct range));
+    len = n_ranges*sizeof(struct range);
+  } else {
+    info->format = ACK_BITMAP;
+    info->upto = cum + nbits;
+    info->count = nbits;
+    for (i = 0; i < nbits; i += 32)
+      bits[i/32] = recvmap_word(recvmap, cum + i);
+    if (nbits % 32 != 0)
+      bits[nbits/32] &= (1u << (nbits % 32)) - 1;
+    len = (nbits+31)/32*4;
+  }
+  if (send_when_available(sockfd, &ack, PKT_HDR + sizeof(struct ack_info) + len, addr, addrlen) < 0)
+    error("ERROR in sendto");
+}
+
+int n_workers = 1; // set with -w
+struct worker *workers;
+uint64_t start_us; // when the server started
+struct file_cache cache;
+struct put_groups striped_puts;
+
+void cache_unlink(struct file_cache *c, struct cache_entry *e){
+  if (e->prev != NULL)
+    e->prev->next = e->next;
+  else
+    c->head = e->next;
+  if (e->next != NULL)
+    e->next->prev = e->prev;
+  else
+    c->tail = e->prev;
+}
+
+// Makes e the most recently used entry
+void cache_push(struct file_cache *c, struct cache_entry *e){
+  e->prev = NULL;
+  e->next = c->head;
+  if (c->head != NULL)
+    c->head->prev = e;
+  c->head = e;
+  if (c->tail == NULL)
+    c->tail = e;
+}
+
+void cache_drop(struct file_cache *c, struct cache_entry *e){
+  cache_unlink(c, e);
+  munmap(e->map, e->size);
+  c->bytes -= e->size;
+  c->n_entries--;
+  free(e);
+}
+
+int cache_matches(struct cache_entry *e, struct stat *st){
+  return (e->dev == st->st_dev) && (e->ino == st->st_ino) && (e->size == (uint64_t)st->st_size)
+    && (e->mtime == (uint64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec);
+}
+
+// Stops serving path from the cache; the entry goes once no get uses it.
+// Called with the lock held.
+void cache_forget_locked(struct file_cache *c, char *path){
+  struct cache_entry *e;
+
+  for (e = c->head; e != NULL; e = e->next){
+    if (strcmp(e->path, path) == 0){
+      e->path[0] = '\0';
+      if (e->refs == 0)
+        cache_drop(c, e);
+      return;
+    }
+  }
+}
+
+void cache_forget(struct file_cache *c, char *path){
+  pthread_mutex_lock(&c->lock);
+  cache_forget_locked(c, path);
+  pthread_mutex_unlock(&c->lock);
+}
+
+/*
+ * Looks up the image of path, opened and measured as st. Returns it with a
+ * reference for the caller, or NULL on a miss; an image of an older
+ * version of the file is forgotten.
+ */
+struct cache_entry *cache_get(struct file_cache *c, char *path, struct stat *st){
+  struct cache_entry *e;
+
+  if (c->budget == 0)
+    return NULL;
+  pthread_mutex_lock(&c->lock);
+  for (e = c->head; e != NULL; e = e->next){
+    if (strcmp(e->path, path) == 0)
+      break;
+  }
+  if ((e != NULL) && !cache_matches(e, st)){
+    cache_forget_locked(c, path);
+    e = NULL;
+  }
+  if (e != NULL){
+    e->refs++;
+    cache_unlink(c, e);
+    cache_push(c, e);
+    c->hits++;
+  } else {
+    c->misses++;
+  }
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+/*
+ * Hands the mapping of path, measured as st, to the cache after a miss,
+ * evicting unused images to make room. Returns the new entry with a
+ * reference for the caller, or NULL if it does not fit, in which case the
+ * mapping stays the caller's.
+ */
+struct cache_entry *cache_add(struct file_cache *c, char *path, struct stat *st, char *map){
+  struct cache_entry *e;
+  struct cache_entry *prev;
+  uint64_t size = st->st_size;
+
+  if ((size > c->budget) || (strlen(path) >= sizeof(e->path)))
+    return NULL;
+  pthread_mutex_lock(&c->lock);
+  for (e = c->head; e != NULL; e = e->next){
+    if (strcmp(e->path, path) == 0)
+      break;
+  }
+  // Another worker may have added the same file meanwhile
+  if (e != NULL){
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+  }
+  for (e = c->tail; (e != NULL) && (c->bytes + size > c->budget); e = prev){
+    prev = e->prev;
+    if (e->refs == 0){
+      cache_drop(c, e);
+      c->evictions++;
+    }
+  }
+  if (c->bytes + size > c->budget){
+    pthread_mutex_unlock(&c->lock);
+    return NULL;
+  }
+  e = calloc(1, sizeof(struct cache_entry));
+  if (e == NULL)
+    error("ERROR allocating cache entry");
+  strcpy(e->path, path);
+  e->dev = st->st_dev;
+  e->ino = st->st_ino;
+  e->size = size;
+  e->mtime = (uint64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+  e->map = map;
+  e->refs = 1;
+  cache_push(c, e);
+  c->bytes += size;
+  c->n_entries++;
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+// Gives back a get's reference to an image
+void cache_put(struct file_cache *c, struct cache_entry *e){
+  pthread_mutex_lock(&c->lock);
+  e->refs--;
+  if ((e->refs == 0) && (e->path[0] == '\0'))
+    cache_drop(c, e);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Finds the content hash of bytes [base, base + len) of a cached file
+int cache_digest(struct file_cache *c, struct cache_entry *e, uint64_t base, uint64_t len, uint64_t *digest){
+  int found = 0;
+  int i;
+
+  pthread_mutex_lock(&c->lock);
+  for (i = 0; (i < e->n_digests) && !found; i++){
+    if ((e->digests[i].base == base) && (e->digests[i].len == len)){
+      *digest = e->digests[i].digest;
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&c->lock);
+  return found;
+}
+
+// Records the content hash of a stripe a get has sent in full
+void cache_save_digest(struct file_cache *c, struct cache_entry *e, uint64_t base, uint64_t len, uint64_t digest){
+  struct stripe_digest *d;
+
+  pthread_mutex_lock(&c->lock);
+  d = &e->digests[e->n_digests < CACHE_DIGESTS ? e->n_digests++ : (base/STRIPE_ALIGN) % CACHE_DIGESTS];
+  d->base = base;
+  d->len = len;
+  d->digest = digest;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void print_cache_stats(struct file_cache *c){
+  pthread_mutex_lock(&c->lock);
+  printf("file cache: %d files, %llu of %llu MB, %llu hits, %llu misses (%.1f%% hit rate), %llu evictions\n",
+    c->n_entries, (unsigned long long)(c->bytes >> 20), (unsigned long long)(c->budget >> 20), (unsigned long long)c->hits,
+    (unsigned long long)c->misses, c->hits + c->misses ? 100.0*c->hits/(c->hits + c->misses) : 0.0, (unsigned long long)c->evictions);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// Closes the file a get sends from; a cached image goes back to the cache,
+// once the reader no longer touches it
+void release_source(struct session *s){
+  if (s->cached == NULL){
+    close_source(&s->src);
+    return;
+  }
+  s->src.map = NULL;
+  close_source(&s->src);
+  cache_put(&cache, s->cached);
+  s->cached = NULL;
+}
+
+void print_worker_stats(struct worker *wk){
+  printf("worker %d (cpu %d): %llu gets, %llu puts, %d open, %llu datagrams in (%.1f per call), %llu out\n",
+    wk->index, wk->cpu, (unsigned long long)wk->n_gets, (unsigned long long)wk->n_puts, wk->n_sessions,
+    (unsigned long long)wk->n_recv, wk->n_recv_calls ? (double)wk->n_recv/wk->n_recv_calls : 0.0, (unsigned long long)wk->n_sent);
+}
+
+// Counters of a session so far; a get's sending side is read from its window while it has one
+void session_stats(struct session *s, struct stats *st){
+  *st = s->st;
+  if (s->w != NULL)
+    sender_stats(st, s->w, &s->src, s->fec);
+}
+
+/*
+ * Publishes a worker's counters for the stats dump: its finished transfers
+ * plus the ones in progress. Only the worker may look at its sessions, so
+ * it copies them out itself, every STATS_INTERVAL_US while it has any.
+ */
+void publish_stats(struct worker *wk, uint64_t now){
+  struct stats live = wk->totals;
+  struct stats st;
+  int i;
+
+  for (i = 0; i < SESSION_SLOTS; i++){
+    if (wk->sessions[i] == NULL)
+      continue;
+    session_stats(wk->sessions[i], &st);
+    add_stats(&live, &st);
+  }
+  pthread_mutex_lock(&wk->lock);
+  wk->live = live;
+  wk->live_sessions = wk->n_sessions;
+  pthread_mutex_unlock(&wk->lock);
+  wk->next_publish = now + STATS_INTERVAL_US;
+}
+
+// Writes each worker's published counters and their sum as JSON, once SIGUSR1 asked for them
+void dump_stats(void){
+  struct stats total;
+  struct stats live;
+  char tmp[256];
+  FILE *out;
+  int active = 0;
+  int n;
+  int i;
+
+  dump_requested = 0;
+  out = open_dump(tmp, sizeof(tmp));
+  if (out == NULL)
+    return;
+  bzero(&total, sizeof(total));
+  fprintf(out, "{\"pid\": %d, \"uptime_s\": %.1f, \"workers\": [", getpid(), (now_us() - start_us)/1e6);
+  for (i = 0; i < n_workers; i++){
+    pthread_mutex_lock(&workers[i].lock);
+    live = workers[i].live;
+    n = workers[i].live_sessions;
+    pthread_mutex_unlock(&workers[i].lock);
+    fprintf(out, "%s{\"index\": %d, \"active\": %d, ", i > 0 ? ", " : "", i, n);
+    print_stats_json(out, &live);
+    fprintf(out, "}");
+    add_stats(&total, &live);
+    active += n;
+  }
+  fprintf(out, "], \"active\": %d, ", active);
+  print_stats_json(out, &total);
+  pthread_mutex_lock(&cache.lock);
+  fprintf(out, ", \"cache\": {\"files\": %d, \"bytes\": %llu, \"budget\": %llu, \"hits\": %llu, \"misses\": %llu, \"hit_rate\": %.3f, \"evictions\": %llu}",
+          cache.n_entries, (unsigned long long)cache.bytes, (unsigned long long)cache.budget, (unsigned long long)cache.hits,
+          (unsigned long long)cache.misses, cache.hits + cache.misses ? (double)cache.hits/(cache.hits + cache.misses) : 0.0,
+          (unsigned long long)cache.evictions);
+  pthread_mutex_unlock(&cache.lock);
+  fprintf(out, "}\n");
+  close_dump(out, tmp);
+}
+
+// Home slot of a session ID in the table
+uint32_t session_slot(uint32_t id){
+  return (id*2654435761u) >> (32 - SESSION_BITS);
+}
+
+struct session *find_session(struct worker *wk, uint32_t id){
+  uint32_t i = session_slot(id);
+
+  while (wk->sessions[i] != NULL){
+    if (wk->sessions[i]->id == id)
+      return wk->sessions[i];
+    i = (i + 1) & (SESSION_SLOTS - 1);
+  }
+  return NULL;
+}
+
+// Creates a session in the table; NULL if the table is full
+struct session *new_session(struct worker *wk, uint32_t id, int state, char *filename, struct sockaddr_storage *from, socklen_t fromlen){
+  struct session *s;
+  uint32_t i;
+
+  if (wk->n_sessions >= MAX_SESSIONS){
+    printf("Too many sessions, dropping %s\n", filename);
+    return NULL;
+  }
+  s = calloc(1, sizeof(struct session));
+  if (s == NULL)
+    error("ERROR allocating session");
+  s->id = id;
+  s->state = state;
+  s->worker = wk;
+  strncpy(s->filename, filename, sizeof(s->filename) - 1);
+  strcpy(s->path, s->filename);
+  memcpy(&s->addr, from, fromlen);
+  s->addrlen = fromlen;
+  s->fd = -1;
+  s->base_fd = -1;
+  s->last_recv = now_us();
+
+  i = session_slot(id);
+  while (wk->sessions[i] != NULL)
+    i = (i + 1) & (SESSION_SLOTS - 1);
+  wk->sessions[i] = s;
+  wk->n_sessions++;
+  return s;
+}
+
+/*
+ * Frees a session and takes it out of the table. Later entries of the same
+ * probe run are shifted back into the hole, so lookups never stop short.
+ */
+void end_session(struct session *s){
+  struct worker *wk = s->worker;
+  struct session **sessions = wk->sessions;
+  struct stats st;
+  uint32_t i = session_slot(s->id);
+  uint32_t j;
+  uint32_t home;
+
+  // Its counters join the totals, which are published on the next pass
+  session_stats(s, &st);
+  st.transfers = 1;
+  add_stats(&wk->totals, &st);
+  wk->next_publish = 0;
+
+  while (sessions[i] != s)
+    i = (i + 1) & (SESSION_SLOTS - 1);
+  sessions[i] = NULL;
+  wk->n_sessions--;
+  for (j = (i + 1) & (SESSION_SLOTS - 1); sessions[j] != NULL; j = (j + 1) & (SESSION_SLOTS - 1)){
+    home = session_slot(sessions[j]->id);
+    if (((j - home) & (SESSION_SLOTS - 1)) >= ((j - i) & (SESSION_SLOTS - 1))){
+      sessions[i] = sessions[j];
+      sessions[j] = NULL;
+      i = j;
+    }
+  }
+
+  if (s->w != NULL){
+    wk->n_sent += s->b->n_msgs;
+    free(s->fec);
+    free(s->w);
+    batch_free(s->b);
+    release_source(s);
+  } else if (s->state == SESSION_PROBE){
+    release_source(s);
+  }
+  if (s->fd >= 0){
+    if (wk->writer.bufs != NULL)
+      writer_drain(&wk->writer); // its last packets may still be queued
+    close(s->fd);
+  }
+  if (s->base_fd >= 0)
+    close(s->base_fd);
+  recvmap_free(&s->recvmap);
+  fec_store_free(&s->fec_store);
+  free(s);
+  if (log_level >= LOG_DEBUG)
+    print_worker_stats(wk);
+}
+
+// Packets of a session must come from the client that opened it
+int same_peer(struct session *s, struct sockaddr_storage *from){
+  return memcmp(&s->addr, from, s->addrlen) == 0;
+}
+
+/*
+ * Starts sending fp, or one stripe of it, compressed with codec, as a get
+ * of filename. Sending waits until run_get has probed the path MTU. A file
+ * that may be cached is sent from the file cache's image of it when there
+ * is one, and its own mapping is handed to the cache otherwise.
+ */
+void start_source(struct worker *wk, FILE *fp, char *filename, int cacheable, int stripe, int n_stripes, int codec, uint32_t id, struct sockaddr_storage *from, socklen_t fromlen){
+  struct session *s;
+  struct stat st;
+  uint64_t file_bytes;
+  uint64_t stripe_bytes;
+
+  // find file size
+  if (fstat(fileno(fp), &st) < 0)
+    error("ERROR in fstat");
+  file_bytes = st.st_size;
+  LOG(LOG_INFO, "Found %llu bytes in file\n", (unsigned long long)file_bytes);
+  s = new_session(wk, id, SESSION_PROBE, filename, from, fromlen);
+  if (s == NULL){
+    fclose(fp);
+    return;
+  }
+  s->cached = cacheable ? cache_get(&cache, filename, &st) : NULL;
+  if (s->cached != NULL){
+    LOG(LOG_INFO, "Sending %s from the file cache\n", filename);
+    open_source(&s->src, fp, 0);
+    s->src.size = file_bytes;
+    s->src.map = s->cached->map;
+  } else {
+    open_source(&s->src, fp, file_bytes);
+    if (cacheable && (s->src.map != NULL))
+      s->cached = cache_add(&cache, filename, &st, s->src.map);
+  }
+  s->src.codec = codec;
+  s->src.mtime = (uint64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+  stripe_range(file_bytes, stripe, n_stripes, &s->src.base, &stripe_bytes);
+  s->src.end = s->src.base + stripe_bytes;
+  s->one_flight = stripe_bytes <= SMALL_PACKETS*DATASIZE;
+  if ((s->cached != NULL) && cache_digest(&cache, s->cached, s->src.base, stripe_bytes, &s->digest)){
+    s->cached_digest = 1;
+    s->src.hashed = stripe_bytes; // nothing left to hash
+  }
+  s->probe.timeout_us = rto_timeout(&s->rto);
+  wk->n_gets++;
+}
+
+// Opens a file for a get command
+void start_get(struct worker *wk, char *filename, int stripe, int n_stripes, int codec, uint32_t id, struct sockaddr_storage *from, socklen_t fromlen){
+  FILE *fp;
+
+  fp = open_file(filename);
+  if (fp == NULL){
+    return;
+  }
+  start_source(wk, fp, filename, 1, stripe, n_stripes, codec, id, from, fromlen);
+}
+
+/*
+ * Writes the block signatures of filename to an anonymous temporary file
+ * and returns it. A missing file has no blocks, so the client of the delta
+ * put sends everything as literals.
+ */
+FILE *sign_file(char *filename){
+  struct sig_info info;
+  struct block_sig sig;
+  struct stat st;
+  uint32_t a;
+  uint32_t b;
+  uint32_t i;
+  char *buf;
+  FILE *out;
+  int fd;
+
+  out = tmpfile();
+  if (out == NULL){
+    perror("ERROR in tmpfile");
+    return NULL;
+  }
+  bzero(&info, sizeof(info));
+  bzero(&sig, sizeof(sig));
+  fd = open(filename, O_RDONLY);
+  if ((fd >= 0) && (fstat(fd, &st) == 0))
+    info.file_bytes = st.st_size;
+  info.block = sig_block(info.file_bytes);
+  info.n_blocks = info.file_bytes/info.block;
+  buf = malloc(info.block);
+  if (buf == NULL)
+    error("ERROR allocating signature buffer");
+  fwrite(&info, sizeof(info), 1, out);
+  for (i = 0; i < info.n_blocks; i++){
+    if (pread(fd, buf, info.block, (off_t)i*info.block) != info.block){
+      perror("ERROR reading for signatures");
+      info.n_blocks = i;
+      rewind(out);
+      fwrite(&info, sizeof(info), 1, out);
+      break;
+    }
+    sig.weak = weak_sum((uint8_t *)buf, info.block, &a, &b);
+    sig.strong = xxh64_of(buf, info.block);
+    fwrite(&sig, sizeof(sig), 1, out);
+  }
+  free(buf);
+  if (fd >= 0)
+    close(fd);
+  fflush(out);
+  rewind(out);
+  return out;
+}
+
+/*
+ * Sends the signatures of a file for a delta put like a get of
+ * ".name.sig", which is the name the client confirms it under
+ */
+void start_signatures(struct worker *wk, char *filename, char *name, uint32_t id, struct sockaddr_storage *from, socklen_t fromlen){
+  char signame[160];
+  FILE *fp;
+
+  fp = sign_file(filename);
+  if (fp == NULL)
+    return;
+  snprintf(signame, sizeof(signame), "files/.%s.sig", name);
+  start_source(wk, fp, signame, 0, 0, 1, CODEC_NONE, id, from, fromlen);
+}
+
+// Sends EOF with the content hash of the stripe
+void send_eof(struct session *s, int sockfd){
+  struct packet filebuf;
+  char *eof = EOF_MARKER;
+
+  bzero(&filebuf, BUFSIZE);
+  filebuf.id = MAX_ID;
+  filebuf.session = s->id;
+  strncpy(filebuf.data, eof, strlen(eof));
+  memcpy(&filebuf.data[strlen(eof)], &s->digest, sizeof(s->digest));
+  if (send_when_available(sockfd, &filebuf, PKT_HDR + strlen(eof) + sizeof(s->digest), (struct sockaddr *)&s->addr, s->addrlen) < 0)
+    error("ERROR in sendto");
+  LOG(LOG_INFO, "EOF sent\n");
+}
+
+/*
+ * Sends the header once probing picked datasize; 0 if the file is too large.
+ * A small file follows at once, every packet and then the EOF, so the client
+ * can confirm it after a single round trip. Should any of it be lost, the
+ * client's ACKs repair it as usual, and the EOF is sent again afterwards.
+ */
+int start_send(struct session *s, int sockfd, uint32_t datasize, uint64_t now){
+  uint64_t stripe_bytes = s->src.end - s->src.base;
+  uint32_t fec_n = s->one_flight ? 0 : fec_block;
+  uint32_t n_packets;
+  uint32_t packet_id;
+
+  if (fec_n > 0)
+    datasize -= sizeof(struct repair_info); // so repair packets fit the path too
+  if ((stripe_bytes + datasize - 1)/datasize >= MAX_PACKETS){
+    printf("File %s is too large to send\n", s->filename);
+    return 0;
+  }
+  n_packets = (stripe_bytes + datasize - 1)/datasize;
+  s->src.datasize = datasize;
+  if (!s->one_flight)
+    reader_start(&s->src, n_packets); // even a cached image may have been reclaimed
+
+  // Send header
+  s->header_len = build_header(&s->header, s->id, &s->src, n_packets, fec_n, s->one_flight ? HEADER_EOF_FOLLOWS : 0);
+  if (sendto(sockfd, &s->header, s->header_len, 0, (struct sockaddr *)&s->addr, s->addrlen) < 0)
+    error("ERROR in sendto");
+  LOG(LOG_INFO, "HEADER sent: %u packets of %u bytes\n", n_packets, datasize);
+
+  s->w = calloc(1, sizeof(struct window));
+  if (s->w == NULL)
+    error("ERROR allocating send window");
+  s->w->end = n_packets;
+  if (fec_n > 0){
+    s->fec = calloc(1, sizeof(struct fec));
+    if (s->fec == NULL)
+      error("ERROR allocating FEC packets");
+    s->w->fec_n = fec_n;
+  }
+  s->b = batch_alloc((struct sockaddr *)&s->addr, s->addrlen);
+  s->b->session = s->id;
+  s->b->dgram = PKT_HDR + datasize;
+  enable_gso(s->b, sockfd);
+  s->cc.ops = cc_algo;
+  s->cc.ops->init(&s->cc);
+  s->state = SESSION_SEND;
+  s->w->delivered_us = now;
+  s->next_send = now;
+  s->last_header = now;
+  s->next_scan = now + rto_timeout(&s->rto);
+  s->next_progress = now + PROGRESS_US;
+  if (s->one_flight && (n_packets > 0)){
+    read_ahead(&s->src, s->w);
+    while (pick_packet(s->w, n_packets, &packet_id))
+      send_window_packet(s->w, packet_id, &s->src, s->b, sockfd);
+    batch_flush(s->b, sockfd);
+    if (!s->cached_digest)
+      s->digest = xxh64_digest(&s->src.hash); // every packet was hashed as it went out
+    send_eof(s, sockfd);
+  }
+  return 1;
+}
+
+// Logs the counters of a get whose packets are all delivered, settles its
+// content hash and frees its window
+void finish_send(struct session *s){
+  struct window *w = s->w;
+  struct cc *cc = &s->cc;
+
+  LOG(LOG_INFO, "All %u packets acknowledged, %u retransmitted\n", w->end, w->n_retx);
+  LOG(LOG_INFO, "%s: cwnd %.0f packets, %.0f packets/s, srtt %llu us\n", cc->ops->name, cc->cwnd, cc->pacing_rate, (unsigned long long)cc->srtt_us);
+  if(s->fec != NULL)
+    LOG(LOG_INFO, "FEC: %llu repair packets sent, %u packets rebuilt by the client\n", (unsigned long long)s->fec->n_sent, w->repaired);
+  if(s->src.codec != CODEC_NONE)
+    LOG(LOG_INFO, "%s: %llu bytes sent for %llu bytes of file (%.2fx)\n", codec_names[s->src.codec], (unsigned long long)s->src.n_packed, (unsigned long long)s->src.n_raw, s->src.n_packed ? (double)s->src.n_raw/s->src.n_packed : 1.0);
+  if(s->src.n_zero > 0)
+    LOG(LOG_INFO, "%llu packets of zeros sent as holes\n", (unsigned long long)s->src.n_zero);
+  print_batch_stats("sendmmsg", s->b);
+  sender_stats(&s->st, w, &s->src, s->fec);
+  print_stats(s->filename, &s->st);
+  if(!s->cached_digest){
+    hash_upto(&s->src.hash, &s->src.hashed, fileno(s->src.fp), s->src.map, s->src.base, s->src.end - s->src.base);
+    s->digest = xxh64_digest(&s->src.hash);
+    if(s->cached != NULL)
+      cache_save_digest(&cache, s->cached, s->src.base, s->src.end - s->src.base, s->digest);
+  }
+  s->worker->n_sent += s->b->n_msgs;
+  free(s->fec);
+  free(s->w);
+  batch_free(s->b);
+  release_source(s);
+  s->fec = NULL;
+  s->w = NULL;
+}
+
+/*
+ * Advances a get: probes the path, sends what pacing and the window allow,
+ * runs the retransmission timer, then the EOF exchange. Returns when it next
+ * needs to run, or 0 if the session ended.
+ */
+uint64_t run_get(struct session *s, int sockfd, uint64_t now){
+  struct window *w;
+  struct cc *cc = &s->cc;
+  uint32_t datasize;
+  uint32_t packet_id;
+  uint32_t burst = 0;
+  uint64_t next_probe;
+  uint64_t rto_us;
+  int n_repairs;
+  int n_lost;
+
+  if (s->state == SESSION_PROBE){
+    if (s->one_flight){
+      datasize = DATASIZE; // probing would cost more round trips than the file
+    } else {
+      datasize = run_probe(&s->probe, sockfd, s->id, (struct sockaddr *)&s->addr, s->addrlen, now);
+      if (datasize == 0)
+        return probe_deadline(&s->probe);
+      rto_sample(&s->rto, s->probe.rtt_us);
+    }
+    if (!start_send(s, sockfd, datasize, now)){
+      end_session(s);
+      return 0;
+    }
+  }
+  if (s->state == SESSION_SEND_EOF){
+    if (now < s->timer)
+      return s->timer;
+    if (s->tries == EOF_RETRIES){
+      // The cumulative ACK already proved delivery, or the client answered a
+      // single flight with nothing but its confirmation, which was lost
+      if (s->got_ack || s->one_flight)
+        printf("GET file %s success (no confirmation)\n", s->filename);
+      else
+        printf("GET file %s failed: the client never answered\n", s->filename);
+      end_session(s);
+      return 0;
+    }
+    // An empty file is never ACKed, so only the EOFs show the header was lost
+    if ((s->tries > 0) && !s->got_ack){
+      if (sendto(sockfd, &s->header, s->header_len, 0, (struct sockaddr *)&s->addr, s->addrlen) < 0)
+        error("ERROR in sendto");
+    }
+    send_eof(s, sockfd);
+    s->tries++;
+    s->timer = now + rto_timeout(&s->rto);
+    rto_backoff(&s->rto);
+    return s->timer;
+  }
+  w = s->w;
+  if(w->base >= w->end){
+    finish_send(s);
+
+    // Every packet is delivered; send EOF, with the content hash, until the
+    // client confirms
+    s->state = SESSION_SEND_EOF;
+    s->tries = 0;
+    s->timer = now;
+    return now;
+  }
+
+  // Keep up to WINDOW packets in flight; the client's ACKs slide the window
+  // and tell us exactly which packets to retransmit. The congestion
+  // controller limits how much of the window is used and paces the sends.
+  read_ahead(&s->src, w);
+  while((burst < s->b->size) && (s->next_send <= now) && pick_packet(w, cc->cwnd, &packet_id)){
+    send_window_packet(w, packet_id, &s->src, s->b, sockfd);
+    LOG(LOG_TRACE, ". %u .\n", packet_id);
+    n_repairs = send_repairs(s->fec, w, &s->src, packet_id, s->b, sockfd);
+    if(s->next_send + PACING_SLACK_US < now)
+      s->next_send = now - PACING_SLACK_US;
+    s->next_send += (1 + n_repairs)*1e6/cc->pacing_rate;
+    burst += 1 + n_repairs;
+  }
+  batch_flush(s->b, sockfd);
+
+  // Retransmission timer: requeue anything unacknowledged for a whole RTO,
+  // and back off while the timeouts keep finding losses
+  if(tail_probe(w, pto_timeout(&s->rto), s->last_recv, now))
+    return now;
+  if(now >= s->next_scan){
+    rto_us = rto_timeout(&s->rto);
+    if(!s->got_ack && (now - s->last_header >= rto_us)){
+      if (sendto(sockfd, &s->header, s->header_len, 0, (struct sockaddr *)&s->addr, s->addrlen) < 0)
+        error("ERROR in sendto");
+      s->last_header = now;
+    }
+    n_lost = 0;
+    for(packet_id = w->base; packet_id < w->next; packet_id++){
+      struct slot *sl = &w->slots[packet_id % WINDOW];
+      if(!sl->acked && (now - sl->sent_us >= rto_us))
+        n_lost += mark_lost(w, packet_id);
+    }
+    if(n_lost > 0){
+      w->n_timeouts++;
+      cc->ops->on_timeout(cc);
+      cc->recovery_us = now;
+      rto_backoff(&s->rto);
+      if(s->one_flight && !s->got_ack){
+        // Nothing was heard since the flight, so perhaps only the confirmation
+        // was lost; the flight is sent again, EOF included, as EOF retries are
+        if(++s->tries == EOF_RETRIES){
+          finish_send(s);
+          printf("GET file %s success (no confirmation)\n", s->filename);
+          end_session(s);
+          return 0;
+        }
+        while(pick_packet(w, w->end, &packet_id))
+          send_window_packet(w, packet_id, &s->src, s->b, sockfd);
+        batch_flush(s->b, sockfd);
+        send_eof(s, sockfd);
+      }
+    }
+    s->next_scan = now + rto_timeout(&s->rto)/4;
+  }
+  if(now >= s->next_progress){
+    LOG(LOG_INFO, "%s: %u of %u packets acknowledged, srtt %llu us\n", s->filename, w->base, w->end, (unsigned long long)cc->srtt_us);
+    sender_stats(&s->st, w, &s->src, s->fec);
+    print_stats(s->filename, &s->st);
+    s->next_progress = now + PROGRESS_US;
+  }
+  if(now - s->last_recv > IDLE_TIMEOUT_US){
+    printf("Client stopped responding, giving up on %s\n", s->filename);
+    end_session(s);
+    return 0;
+  }
+
+  if(burst >= s->b->size)
+    return now;
+  if(have_packet(w, cc->cwnd) && (s->next_send < s->next_scan))
+    return s->next_send;
+  if(read_stalled(w) && (now + READ_POLL_US < s->next_scan))
+    return now + READ_POLL_US;
+  next_probe = tail_probe_at(w, pto_timeout(&s->rto), s->last_recv);
+  if((next_probe != 0) && (next_probe < s->next_scan))
+    return next_probe;
+  return s->next_scan;
+}
+
+// Handles a packet from the client of a get
+void get_packet(struct session *s, struct packet *pkt, int n){
+  struct window *w = s->w;
+  struct cc_sample rs;
+  int eof_sent = (s->state == SESSION_SEND_EOF) || ((s->state == SESSION_SEND) && s->one_flight);
+
+  // The client of a get only sends control datagrams, which fit BUFSIZE
+  if(n > BUFSIZE)
+    return;
+  if((s->state == SESSION_PROBE) && (pkt->id == PROBE_ID)){
+    probe_reply(&s->probe, pkt, n, s->last_recv);
+    return;
+  }
+  if(eof_sent && (n > PKT_HDR) && (pkt->id == 0) && (strncmp(s->filename, &pkt->data[0], strlen(s->filename)) == 0)){ // Success
+    LOG(LOG_INFO, "Completion of file %s\n", s->filename);
+    if(w != NULL)
+      finish_send(s); // the confirmation of a single flight stands in for its ACK
+    printf("GET file %s success!\n", s->filename);
+    end_session(s);
+    return;
+  }
+  if(eof_sent && (n > PKT_HDR) && (pkt->id == 0) && (strncmp(&pkt->data[0], BAD_HASH, strlen(BAD_HASH)) == 0)){
+    printf("GET file %s failed: the client's content hash does not match\n", s->filename);
+    end_session(s);
+    return;
+  }
+  if((s->state != SESSION_SEND) || (pkt->id != ACK_ID))
+    return;
+  process_ack(w, pkt, n, s->rto.srtt_us, &rs);
+  s->got_ack = 1;
+  rto_sample(&s->rto, rs.echo_us);
+  s->cc.ops->on_ack(&s->cc, &rs, s->last_recv);
+  if(rs.lost && (rs.lost_sent_us > s->cc.recovery_us)){
+    s->cc.ops->on_loss(&s->cc, &rs);
+    s->cc.recovery_us = s->last_recv;
+  }
+}
+
+/*
+ * Opens the output file for a put; the transfer starts with the header. Gets
+ * may be sending the old file from a mapping, so a put never writes it in
+ * place: it writes a hidden ".name.put" beside it, or ".name.delta" for a
+ * delta put, which copies from the old file, and the temporary replaces the
+ * file once complete. The temporary is not truncated here, since the
+ * sessions of a striped put all write into it; each sizes it from its
+ * header instead.
+ */
+void start_put(struct worker *wk, char *filename, int stripe, int n_stripes, int codec, uint32_t id, struct sockaddr_storage *from, socklen_t fromlen){
+  struct session *s;
+  char *slash = strrchr(filename, '/');
+  int dirlen = slash == NULL ? 0 : slash - filename + 1;
+  int fd;
+
+  s = new_session(wk, id, SESSION_RECV_HEADER, filename, from, fromlen);
+  if (s == NULL)
+    return;
+  s->stripe = stripe;
+  s->n_stripes = n_stripes;
+  if (codec == CODEC_DELTA){
+    snprintf(s->path, sizeof(s->path), "%.*s.%s.delta", dirlen, filename, &filename[dirlen]);
+    s->base_fd = open(filename, O_RDONLY);
+  } else {
+    snprintf(s->path, sizeof(s->path), "%.*s.%s.put", dirlen, filename, &filename[dirlen]);
+  }
+
+  // create file
+  fd = open(s->path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0){
+    printf("Error opening file %s for writing\n", s->path);
+    end_session(s);
+    return;
+  }
+  s->fd = fd;
+  if (wk->writer.bufs == NULL)
+    writer_start(&wk->writer, MAX_DATASIZE);
+  wk->n_puts++;
+}
+
+/*
+ * Records whether a stripe of a put checked out. Returns 1 once every stripe
+ * of the put has, when its temporary is ready to replace the file.
+ */
+int put_stripe_done(struct put_groups *g, struct session *s){
+  uint64_t all = s->n_stripes == 64 ? ~0ull : (1ull << s->n_stripes) - 1;
+  struct put_group **p;
+  struct put_group *e;
+  int done;
+
+  if (s->n_stripes == 1)
+    return s->verified;
+  pthread_mutex_lock(&g->lock);
+  for (p = &g->head; (*p != NULL) && (strcmp((*p)->path, s->path) != 0); p = &(*p)->next)
+    ;
+  e = *p;
+  if (e == NULL){
+    e = calloc(1, sizeof(struct put_group));
+    if (e == NULL)
+      error("ERROR allocating put group");
+    strcpy(e->path, s->path);
+    *p = e;
+  }
+  if ((e->n_stripes != s->n_stripes) || (e->file_bytes != s->info.file_bytes) || (e->mtime != s->info.mtime)){
+    e->n_stripes = s->n_stripes;
+    e->file_bytes = s->info.file_bytes;
+    e->mtime = s->info.mtime;
+    e->verified = 0;
+  }
+  if (s->verified)
+    e->verified |= 1ull << s->stripe;
+  else
+    e->verified &= ~(1ull << s->stripe);
+  done = e->verified == all;
+  if (done){
+    *p = e->next;
+    free(e);
+  }
+  pthread_mutex_unlock(&g->lock);
+  return done;
+}
+
+// Tells the client its upload is complete, or that its content hash did not match
+void send_confirmation(struct session *s, int sockfd){
+  struct packet filebuf;
+
+  bzero(&filebuf, BUFSIZE);
+  filebuf.session = s->id;
+  if (s->verified)
+    strncpy(filebuf.data, s->filename, strlen(s->filename));
+  else
+    strcpy(filebuf.data, BAD_HASH);
+  if (sendto(sockfd, &filebuf, BUFSIZE, 0, (struct sockaddr *)&s->addr, s->addrlen) < 0)
+    error("ERROR in sendto");
+  LOG(LOG_INFO, "Server sent completion acknowledgment\n");
+}
+
+// Handles a packet from the client of a put
+void put_packet(struct session *s, int sockfd, struct packet *pkt, int n){
+  uint32_t packet_id = pkt->id;
+  struct header_info *info = &s->info;
+  uint32_t restored;
+  int queued;
+
+  if(s->state == SESSION_RECV_HEADER){
+    if(packet_id == PROBE_ID){
+      echo_probe(sockfd, pkt, n, (struct sockaddr *)&s->addr, s->addrlen);
+      return;
+    }
+    if((n > BUFSIZE) || !parse_header(pkt, n, info))
+      return;
+    LOG(LOG_INFO, "Received header: %llu bytes, %u packets of %u bytes expected\n", (unsigned long long)info->stripe_bytes, info->n_packets, info->datasize);
+
+    // The bitmap is sized from the header, so it lives on the heap
+    if ((recvmap_alloc(&s->recvmap, info->n_packets) < 0) || (fec_store_alloc(&s->fec_store, info) < 0)){
+      printf("Not enough memory to receive %u packets\n", info->n_packets);
+      end_session(s);
+      return;
+    }
+
+    // Pick up where an interrupted attempt left off, then size the file
+    restored = load_checkpoint(s->path, s->fd, info, &s->recvmap, &s->cum, &s->highest);
+    size_file(s->fd, info);
+    if (restored > 0){
+      LOG(LOG_INFO, "Resuming %s: %u of %u packets already received\n", s->filename, restored, info->n_packets);
+      send_ack(sockfd, s->id, &s->recvmap, s->cum, s->highest, s->ts_echo, &s->st, (struct sockaddr *)&s->addr, s->addrlen);
+    }
+    s->last_ack = s->last_checkpoint = s->last_recv;
+    s->next_progress = s->last_recv + PROGRESS_US;
+    xxh64_init(&s->hash);
+    s->state = SESSION_RECV;
+    return;
+  }
+
+  // EOF received; like every control datagram it fits BUFSIZE
+  if(packet_id == MAX_ID){
+    if(n > BUFSIZE)
+      return;
+    LOG(LOG_INFO, "EOF detected\n");
+    if(s->state == SESSION_RECV_DONE){
+      send_confirmation(s, sockfd);
+      return;
+    }
+
+    // Check if file is complete
+    if(recvmap_complete(&s->recvmap)){
+      LOG(LOG_INFO, "File complete\n");
+      writer_drain(&s->worker->writer);
+      print_stats(s->filename, &s->st);
+      s->verified = hash_matches(&s->hash, &s->hashed, s->fd, info, pkt, n);
+      if(s->verified)
+        printf("Content hash verified\n");
+      else
+        printf("Content hash does not match, %s is corrupt\n", s->filename);
+      send_confirmation(s, sockfd);
+      remove_checkpoint(s->path, info->stripe_offset);
+
+      // The temporary replaces the file once every stripe checks out; gets
+      // that are sending the old file keep its mapping. A single stream that
+      // does not check out is dropped.
+      if(put_stripe_done(&striped_puts, s)){
+        if(rename(s->path, s->filename) < 0)
+          perror("ERROR replacing the old copy");
+        cache_forget(&cache, s->filename);
+      } else if((s->n_stripes == 1) && (unlink(s->path) < 0)){
+        perror("ERROR removing the temporary");
+      }
+
+      // Close the file but stay around to answer EOFs whose confirmation was lost
+      close(s->fd);
+      s->fd = -1;
+      s->state = SESSION_RECV_DONE;
+      s->timer = s->last_recv + LINGER_US;
+      return;
+    }
+
+    // Tell the client what is still missing
+    send_ack(sockfd, s->id, &s->recvmap, s->cum, s->highest, s->ts_echo, &s->st, (struct sockaddr *)&s->addr, s->addrlen);
+    s->since_ack = 0;
+    s->last_ack = s->last_recv;
+    LOG(LOG_INFO, "Server sent missing packet info\n");
+    return;
+  }
+
+  // A repair packet may rebuild a lost one without a round trip
+  if(packet_id == REPAIR_ID){
+    if((s->state == SESSION_RECV) && rebuild_packet(&s->worker->writer, &s->fec_store, pkt, n, s->fd, info, &s->recvmap, s->cum, &packet_id, &s->st)){
+      s->st.repaired++;
+      s->since_ack++;
+      if(packet_id + 1 > s->highest)
+        s->highest = packet_id + 1;
+      s->cum = recvmap_missing(&s->recvmap, s->cum, info->n_packets);
+    }
+    return;
+  }
+
+  // Ignore repeated headers, stray packets and anything beyond the window
+  if((s->state != SESSION_RECV) || (packet_id >= info->n_packets) || (packet_id >= s->cum + WINDOW) || (n - PKT_HDR > (int)info->datasize))
+    return;
+
+  // A packet that fails its CRC is dropped, and the client repairs it like a
+  // lost one
+  if(pkt->crc != packet_crc(pkt, &pkt->data[0], n - PKT_HDR)){
+    s->st.crc_drops++;
+    return;
+  }
+  if((s->ts_echo == 0) || ((int32_t)(pkt->ts - s->ts_echo) > 0))
+    s->ts_echo = pkt->ts;
+
+  s->since_ack++;
+  if(!recvmap_has(&s->recvmap, packet_id)){
+    // Queue for the file, decompressed, and mark received
+    queued = write_packet(&s->worker->writer, &s->fec_store, s->fd, s->base_fd, info, packet_id, &pkt->data[0], n - PKT_HDR, &s->st);
+    if(queued <= 0){
+      if(queued == 0)
+        s->st.crc_drops++;
+      return;
+    }
+    LOG(LOG_TRACE, ". %u .\n", packet_id);
+    recvmap_set(&s->recvmap, packet_id);
+    s->st.pkts_recv++;
+    s->st.bytes_recv += n - PKT_HDR;
+
+    if(packet_id + 1 > s->highest)
+      s->highest = packet_id + 1;
+    s->cum = recvmap_missing(&s->recvmap, s->cum, info->n_packets);
+  } else {
+    s->st.dups++;
+  }
+
+  // Hash what has arrived in order, and save the bitmap now and then so an
+  // interrupted put can resume
+  hash_received(&s->hash, &s->hashed, s->fd, info, written_upto(&s->worker->writer, &s->mark, s->cum));
+  if((s->last_recv - s->last_checkpoint >= CHECKPOINT_US) && queue_checkpoint(&s->worker->writer, s->path, s->fd, info, s->recvmap.bits, s->recvmap.len))
+    s->last_checkpoint = s->last_recv;
+}
+
+/*
+ * Advances a put. While data flows, ACK every ACK_EVERY packets, on any gap,
+ * and at least every ACK_INTERVAL_US. Returns when it next needs to run, or
+ * 0 if the session ended.
+ */
+uint64_t run_put(struct session *s, int sockfd, uint64_t now){
+  if(s->state == SESSION_RECV_DONE){
+    if(now < s->timer)
+      return s->timer;
+    end_session(s);
+    return 0;
+  }
+
+  // ACK early when there is a gap so the client can repair it quickly
+  if((s->since_ack > 0) && ((s->since_ack >= ACK_EVERY) || (s->highest > s->cum) || (s->cum == s->info.n_packets) || (now >= s->last_ack + ACK_INTERVAL_US))){
+    send_ack(sockfd, s->id, &s->recvmap, s->cum, s->highest, s->ts_echo, &s->st, (struct sockaddr *)&s->addr, s->addrlen);
+    s->since_ack = 0;
+    s->last_ack = now;
+  }
+  if((s->state == SESSION_RECV) && (now >= s->next_progress)){
+    LOG(LOG_INFO, "%s: %u of %u packets received\n", s->filename, s->cum, s->info.n_packets);
+    print_stats(s->filename, &s->st);
+    s->next_progress = now + PROGRESS_US;
+  }
+  if(now - s->last_recv >= IDLE_TIMEOUT_US){
+    printf("Client stopped responding, giving up on %s\n", s->filename);
+    if(s->state == SESSION_RECV){
+      writer_drain(&s->worker->writer);
+      save_checkpoint(s->path, s->fd, &s->info, s->recvmap.bits, s->recvmap.len);
+    }
+    end_session(s);
+    return 0;
+  }
+  if(s->since_ack > 0)
+    return s->last_ack + ACK_INTERVAL_US;
+  return s->last_recv + IDLE_TIMEOUT_US;
+}
+
+/*
+ * Reads the optional "-s i/n " in front of a file name, which asks for
+ * stripe i of n. Returns the file name, or NULL if the stripe is invalid.
+ */
+char *parse_stripe(char *arg, int *stripe, int *n_stripes){
+  int len = 0;
+
+  *stripe = 0;
+  *n_stripes = 1;
+  if (strncmp(arg, "-s ", 3) != 0)
+    return arg;
+  if ((sscanf(&arg[3], "%d/%d %n", stripe, n_stripes, &len) != 2) || (len == 0))
+    return NULL;
+  if ((*n_stripes < 1) || (*n_stripes > MAX_STREAMS) || (*stripe < 0) || (*stripe >= *n_stripes))
+    return NULL;
+  return &arg[3 + len];
+}
+
+// Runs one command packet; get and put open a session for the transfer
+void handle_command(struct worker *wk, struct packet *pkt, int n, struct sockaddr_storage *from){
+  int sockfd = wk->sockfd;
+  struct packet buf;
+  socklen_t fromlen = sizeof(struct sockaddr_in);
+  char cmd[DATASIZE + 1];
+  char *filename; /* filename pointer */
+  char fnamebuf[128];
+  int stripe;
+  int n_stripes;
+  int codec;
+  int i;
+
+  // Commands fit one BUFSIZE datagram, though a receive view can be larger.
+  // Datagrams are not NUL-terminated.
+  if (n - PKT_HDR > DATASIZE)
+    return;
+  memcpy(cmd, pkt->data, n - PKT_HDR);
+  cmd[n - PKT_HDR] = 0;
+
+  bzero(fnamebuf, 128);
+  // get and put may name a codec, then a stripe, before the file name; a put
+  // names its codec in the header as well
+  if((strncmp(cmd, "get", 3) == 0) && ((filename = parse_codec(&cmd[4], &codec)) != NULL) && ((filename = parse_stripe(filename, &stripe, &n_stripes)) != NULL)){
+    LOG(LOG_INFO, "Get file %s (stripe %d/%d, %s)\n", filename, stripe + 1, n_stripes, codec_names[codec]);
+    snprintf(fnamebuf, sizeof(fnamebuf), "files/%s", filename);
+    start_get(wk, &fnamebuf[0], stripe, n_stripes, codec, pkt->session, from, fromlen);
+  } else if ((strncmp(cmd, "put", 3) == 0) && ((filename = parse_codec(&cmd[4], &codec)) != NULL) && ((filename = parse_stripe(filename, &stripe, &n_stripes)) != NULL)){
+    LOG(LOG_INFO, "Put file %s (stripe %d/%d)\n", filename, stripe + 1, n_stripes);
+    snprintf(fnamebuf, sizeof(fnamebuf), "files/%s", filename);
+    start_put(wk, &fnamebuf[0], stripe, n_stripes, codec, pkt->session, from, fromlen);
+  } else if (strncmp(cmd, "sig ", 4) == 0){
+    filename = &cmd[4];
+    LOG(LOG_INFO, "Signatures of file %s\n", filename);
+    snprintf(fnamebuf, sizeof(fnamebuf), "files/%s", filename);
+    start_signatures(wk, &fnamebuf[0], filename, pkt->session, from, fromlen);
+  } else if (strncmp(cmd, "delete", 6) == 0){
+    filename = &cmd[7];
+    LOG(LOG_INFO, "Delete file %s\n", filename);
+    snprintf(fnamebuf, sizeof(fnamebuf), "files/%s", filename);
+    remove(fnamebuf);
+    cache_forget(&cache, fnamebuf);
+  } else if (strncmp(cmd, "ls", 2) == 0){
+    LOG(LOG_INFO, "List files\n");
+    bzero(&buf, BUFSIZE);
+    buf.session = pkt->session;
+    ls(&buf.data[0]);
+    send_when_available(sockfd, &buf, BUFSIZE, (struct sockaddr *)from, fromlen);
+  } else if (strncmp(cmd, "exit", 4) == 0){
+    printf("Exit\n");
+    for (i = 0; i < n_workers; i++)
+      print_worker_stats(&workers[i]);
+    print_cache_stats(&cache);
+    exit(0);
+  } else {
+    printf("Not understood: %s\n", cmd);
+  }
+}
+
+// Hands a received datagram to its session, or runs it as a command
+void dispatch_packet(struct worker *wk, struct packet *pkt, int n, struct sockaddr_storage *from){
+  int sockfd = wk->sockfd;
+  struct session *s;
+
+  if (n < PKT_HDR)
+    return;
+  s = find_session(wk, pkt->session);
+  if (pkt->id == MAX_ID-1){ // Command packets must have this ID
+    if (s == NULL) // a session ID already in use is a duplicate
+      handle_command(wk, pkt, n, from);
+    return;
+  }
+  if ((s == NULL) || !same_peer(s, from)) // left over from an ended session
+    return;
+  s->last_recv = now_us();
+  if (s->state <= SESSION_SEND_EOF)
+    get_packet(s, pkt, n);
+  else
+    put_packet(s, sockfd, pkt, n);
+}
+
+/*
+ * Pins the calling worker to one CPU, spreading workers over the CPUs the
+ * process may run on. Returns the CPU, or -1 if it was left unpinned.
+ */
+int pin_worker(int index){
+  cpu_set_t allowed;
+  cpu_set_t one;
+  int n_cpus;
+  int cpu;
+  int k;
+
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+    return -1;
+  n_cpus = CPU_COUNT(&allowed);
+  if (n_cpus <= 1)
+    return -1;
+  k = index % n_cpus;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++){
+    if (CPU_ISSET(cpu, &allowed) && (k-- == 0))
+      break;
+  }
+  CPU_ZERO(&one);
+  CPU_SET(cpu, &one);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(one), &one) != 0)
+    return -1;
+  return cpu;
+}
+
+/*
+ * Worker thread: runs every session it owns, then waits on its socket and on
+ * one timer, armed for the earliest deadline of any of its sessions
+ */
+void *run_worker(void *arg){
+  struct worker *wk = arg;
+  int sockfd = wk->sockfd;
+  int epfd;
+  int timerfd;
+  int n_msgs;
+  int n_events;
+  int i;
+  uint64_t now;
+  uint64_t next;
+  uint64_t deadline;
+  uint64_t expirations;
+  struct epoll_event ev;
+  struct epoll_event events[2];
+  struct itimerspec its;
+  struct session *s;
+  struct batch *b;
+
+  if (n_workers > 1)
+    wk->cpu = pin_worker(wk->index);
+
+  epfd = epoll_create1(0);
+  if (epfd < 0)
+    error("ERROR in epoll_create1");
+  timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timerfd < 0)
+    error("ERROR in timerfd_create");
+  ev.events = EPOLLIN;
+  ev.data.fd = sockfd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev) < 0)
+    error("ERROR in epoll_ctl");
+  ev.data.fd = timerfd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev) < 0)
+    error("ERROR in epoll_ctl");
+
+  // Every datagram comes in through one batch and is handed to its session
+  // by session ID
+  b = batch_alloc(NULL, 0);
+  set_gro(b, sockfd, 1);
+
+  bzero(&its, sizeof(its));
+  while (1) {
+    now = now_us();
+    if (now >= wk->next_publish)
+      publish_stats(wk, now);
+    if (dump_requested && (wk->index == 0))
+      dump_stats();
+    next = now + IDLE_TIMEOUT_US;
+    if ((wk->n_sessions > 0) && (wk->next_publish < next))
+      next = wk->next_publish;
+    for (i = 0; i < SESSION_SLOTS; i++){
+      s = wk->sessions[i];
+      if (s == NULL)
+        continue;
+      if (s->state <= SESSION_SEND_EOF)
+        deadline = run_get(s, sockfd, now);
+      else
+        deadline = run_put(s, sockfd, now);
+      if ((deadline != 0) && (deadline < next))
+        next = deadline;
+      if ((wk->sessions[i] != s) && (wk->sessions[i] != NULL)) // ending it moved another session here
+        i--;
+    }
+
+    if (next > now){
+      its.it_value.tv_sec = next/1000000;
+      its.it_value.tv_nsec = (next%1000000)*1000;
+      timerfd_settime(timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    }
+    n_events = epoll_wait(epfd, events, 2, next > now ? -1 : 0);
+    if (n_events < 0){
+      if (errno == EINTR)
+        continue;
+      error("ERROR in epoll_wait");
+    }
+    for (i = 0; i < n_events; i++){
+      if (events[i].data.fd == timerfd)
+        read(timerfd, &expirations, sizeof(expirations));
+    }
+
+    n_msgs = batch_recv(b, sockfd);
+    if (n_msgs > 0){
+      wk->n_recv += n_msgs;
+      wk->n_recv_calls++;
+    }
+    for (i = 0; i < n_msgs; i++)
+      dispatch_packet(wk, b->views[i], b->view_len[i], b->view_from[i]);
+    if ((n_msgs > 0) && (wk->writer.bufs != NULL))
+      writer_kick(&wk->writer);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  int sockfd; /* socket */
+  char *port;
+  int optval; /* flag value for setsockopt */
+  int opt;
+  int batch_set = 0;
+  int i;
+  struct sigaction sa;
+  sigset_t usr1;
+
+  /*
+   * check command line arguments
+   */
+  crc32c_init();
+  start_us = now_us();
+  cache.budget = (uint64_t)CACHE_MB << 20;
+  pthread_mutex_init(&cache.lock, NULL);
+  pthread_mutex_init(&striped_puts.lock, NULL);
+  while ((opt = getopt(argc, argv, "b:c:f:gm:s:v:w:")) != -1) {
+    switch (opt) {
+    case 'b': // datagrams per sendmmsg/recvmmsg
+      batch_size = atoi(optarg);
+      batch_set = 1;
+      if ((batch_size < 1) || (batch_size > MAX_BATCH))
+        usage(argv[0]);
+      break;
+    case 'c': // congestion control for our sends
+      if ((cc_algo = find_cc(optarg)) == NULL)
+        usage(argv[0]);
+      break;
+    case 'f': // FEC repair packets for every block of this many
+      fec_block = atoi(optarg);
+      if ((fec_block < 2) || (fec_block > FEC_MAX_BLOCK))
+        usage(argv[0]);
+      break;
+    case 'g': // UDP GSO/GRO segmentation offload
+      offload = 1;
+      if (!batch_set)
+        batch_size = GSO_MAX_SEGS;
+      break;
+    case 'm': // memory budget of the file cache in MB, 0 for none
+      if (atoll(optarg) < 0)
+        usage(argv[0]);
+      cache.budget = (uint64_t)atoll(optarg) << 20;
+      break;
+    case 's': // where SIGUSR1 dumps the counters
+      stats_path = optarg;
+      break;
+    case 'v': // log level, 0 to 3
+      log_level = atoi(optarg);
+      if ((log_level < LOG_QUIET) || (log_level > LOG_TRACE))
+        usage(argv[0]);
+      break;
+    case 'w': // worker threads sharing the port
+      n_workers = atoi(optarg);
+      if ((n_workers < 1) || (n_workers > MAX_WORKERS))
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1)
+    usage(argv[0]);
+  port = argv[optind];
+
+  // BEEJ p. 22
+  int status;
+  struct addrinfo hints;
+  struct addrinfo *servinfo;
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  hints.ai_flags = AI_PASSIVE;
+  if ((status = getaddrinfo(NULL, port, &hints, &servinfo)) != 0){
+    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+    exit(1);
+  }
+
+  workers = calloc(n_workers, sizeof(struct worker));
+  if (workers == NULL)
+    error("ERROR allocating workers");
+
+  // Every worker gets its own socket on the port. They are all bound before
+  // any thread starts, so the kernel's choice of socket for a client does
+  // not change under it.
+  for (i = 0; i < n_workers; i++){
     /*
-     * recvfrom: receive a UDP datagram from a client
+     * socket: create the parent socket
      */
-    bzero(&buf, BUFSIZE);
-    n = recvfrom(sockfd, &buf, BUFSIZE, 0, (struct sockaddr *)&clientaddr, &clientlen);
-    if (n < 0)
-      error("ERROR in recvfrom");
+    sockfd = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (sockfd < 0)
+      error("ERROR opening socket");
 
-    /* 
-     * getnameinfo: determine who sent the datagram
+    /* setsockopt: Handy debugging trick that lets
+     * us rerun the server immediately after we kill it;
+     * otherwise we have to wait about 20 secs.
+     * Eliminates "ERROR on binding: Address already in use" error.
      */
-    char host[1024];
-    char service[20];
-    if(getnameinfo((const struct sockaddr *)&clientaddr, clientlen, host, sizeof(host), 
-      service, sizeof(service), 0) != 0)
-        error("ERROR in getnameinfo");
-    
-    bzero(fnamebuf, 128);
-    if (buf.id != MAX_ID-1){ // Command packets must have this ID; ignore packets leftover from other commands
-      continue;
-    } else if(strncmp(buf.data, "get", 3) == 0){
-      filename = &buf.data[4];
-      printf("Get file %s\n", filename);
-      sprintf(fnamebuf, "files/%s", filename);
-      send_file(&fnamebuf[0], sockfd, (struct sockaddr *)&clientaddr, clientlen);
-    } else if (strncmp(buf.data, "put", 3) == 0){
-      filename = &buf.data[4];
-      printf("Put file %s\n", filename);
-      sprintf(fnamebuf, "files/%s", filename);
-      receive_file(&fnamebuf[0], sockfd, &clientaddr, &clientlen);
-    } else if (strncmp(buf.data, "delete", 6) == 0){
-      filename = &buf.data[7];
-      printf("Delete file %s\n", filename);
-      sprintf(fnamebuf, "files/%s", filename);
-      remove(fnamebuf);
-    } else if (strncmp(buf.data, "ls", 2) == 0){
-      printf("List files\n");
-      bzero(&buf, BUFSIZE);
-      ls(&buf.data[0]);
-      //printf("%s", buf.data);
-      send_when_available(sockfd, &buf, BUFSIZE, (struct sockaddr *)&clientaddr, clientlen);
-    } else if (strncmp(buf.data, "exit", 4) == 0){
-      printf("Exit\n");
-      freeaddrinfo(servinfo);
-      exit(0);
-    } else {
-      printf("Not understood: %s\n", buf.data);
-    }
+    optval = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
+	    &optval, sizeof(optval));
+
+    /* SO_REUSEPORT: the workers' sockets share the port, and the kernel
+     * spreads clients over them by hashing their address and port
+     */
+    if ((n_workers > 1) && (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0))
+      error("ERROR setting SO_REUSEPORT");
+
+    /* Large socket buffers so a full send window fits in the kernel */
+    optval = SOCKBUF_BYTES;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+    setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval));
+
+    /* Don't fragment, so path MTU probes that are too large get dropped */
+    optval = IP_PMTUDISC_PROBE;
+    setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval));
 
+    /*
+     * bind: associate the parent socket with a port
+     */
+    if (bind(sockfd, servinfo->ai_addr, servinfo->ai_addrlen) < 0)
+      error("ERROR on binding");
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+
+    workers[i].index = i;
+    workers[i].cpu = -1;
+    workers[i].sockfd = sockfd;
+    pthread_mutex_init(&workers[i].lock, NULL);
+  }
+  freeaddrinfo(servinfo);
+
+  // SIGUSR1 asks for a stats dump. Only worker 0, on this thread, takes it:
+  // the others start with it blocked. No SA_RESTART, so its epoll_wait
+  // returns and the dump is written at once.
+  bzero(&sa, sizeof(sa));
+  sa.sa_handler = request_dump;
+  sigaction(SIGUSR1, &sa, NULL);
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+
+  /*
+   * main loop: each worker serves the clients the kernel sends to its socket
+   */
+  for (i = 1; i < n_workers; i++){
+    if (pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]) != 0)
+      error("ERROR starting worker");
   }
+  pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+  run_worker(&workers[0]);
+  return 0;
 }